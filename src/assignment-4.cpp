@@ -1,9 +1,14 @@
 #include "material.h"
+#include "muni/accelerator_cache.h"
+#include "muni/cache_counters.h"
 #include "muni/camera.h"
 #include "muni/common.h"
 #include "muni/image.h"
+#include "muni/instance.h"
+#include "muni/mapped_file.h"
 #include "muni/material.h"
 #include "muni/math_helpers.h"
+#include "muni/mesh.h"
 #include "muni/obj_loader.h"
 #include "muni/ray_tracer.h"
 #include "muni/sampler.h"
@@ -12,7 +17,9 @@
 #include "ray_tracer.h"
 #include "spdlog/spdlog.h"
 #include "triangle.h"
+#include <chrono>
 #include <cmath>
+#include <cstdlib>
 #include <iostream>
 #include <thread>
 #include <vector>
@@ -29,7 +36,94 @@ using std::get;
 using std::cout;
 using std::endl;
 
-RayTracer::Octree octree{};
+RayTracer::Accelerator accelerator{};
+// The bunny and the box, in the order the accelerator's build left them
+TriangleMesh scene_triangles;
+// The scene as instances of shared meshes, used instead of accelerator when
+// use_instances is set
+RayTracer::TopLevel instanced_scene{};
+bool use_instances = false;
+
+/** Find the closest hit in the scene, flat or instanced.
+    \param[in] ray_pos The ray origin.
+    \param[in] ray_dir The ray direction.
+    \return The closest hit, if any.
+*/
+HitRecord trace(Vec3f ray_pos, Vec3f ray_dir) {
+    if (use_instances)
+        return RayTracer::closest_hit(ray_pos, ray_dir, instanced_scene);
+    return RayTracer::closest_hit(ray_pos, ray_dir, accelerator,
+                                  scene_triangles);
+}
+
+/** Check whether two points of the scene, flat or instanced, can see each
+    other.
+*/
+bool unoccluded(Vec3f from, Vec3f to) {
+    if (use_instances) return RayTracer::visible(from, to, instanced_scene);
+    return RayTracer::visible(from, to, accelerator, scene_triangles);
+}
+
+/** The triangle a hit returned by trace landed on, in world space. */
+Triangle hit_triangle(const HitRecord &hit) {
+    Triangle tri = use_instances ? instanced_scene.hit_triangle(hit)
+                                 : scene_triangles.triangle(hit.triangle_idx);
+    if (tri.material_id == BoxScene::light_material_id)
+        tri.emission = BoxScene::light_color;
+    return tri;
+}
+
+/** Rebuild the scene as instances: the box once, and the bunny once as a
+    shared mesh placed count times on a grid within its original footprint.
+    \param[in] name The accelerator to build the meshes with.
+    \param[in] bunny_triangles The triangles of the bunny.
+    \param[in] count How many copies of the bunny to place.
+    \param[in] quantize Whether to quantize the meshes' child bounds.
+    \return False if the accelerator name is unknown or its build fails,
+    which is logged, true otherwise.
+*/
+bool build_instanced_scene(const std::string &name,
+                           TriangleMesh bunny_triangles, int count,
+                           bool quantize) {
+    TriangleMesh box_triangles;
+    box_triangles.append(BoxScene::triangles);
+    const auto box = RayTracer::BottomLevel::build(
+        name, std::move(box_triangles), quantize);
+    if (!box) return false;
+    const auto bunny = RayTracer::BottomLevel::build(
+        name, std::move(bunny_triangles), quantize);
+    if (!bunny) return false;
+
+    const Mat3f identity = linalg::identity;
+    instanced_scene.instances.clear();
+    instanced_scene.instances.emplace_back(box, identity, Vec3f{0.0f});
+
+    // A k x k grid of copies scaled by 1 / k, standing on the floor the
+    // bunny stands on
+    int k = 1;
+    while (k * k < count) k++;
+    const float scale = 1.0f / k;
+    const Mat3f scaled{Vec3f{scale, 0.0f, 0.0f}, Vec3f{0.0f, scale, 0.0f},
+                       Vec3f{0.0f, 0.0f, scale}};
+    const RayTracer::BoundingBox3f &bounds = bunny->bounds;
+    const Vec3f extent = bounds.max_point - bounds.min_point;
+    for (int i = 0; i < count; i++) {
+        const Vec3f cell_min = {bounds.min_point.x + (i % k) * extent.x * scale,
+                                bounds.min_point.y + (i / k) * extent.y * scale,
+                                bounds.min_point.z};
+        instanced_scene.instances.emplace_back(
+            bunny, scaled, cell_min - bounds.min_point * scale);
+    }
+    instanced_scene.build();
+
+    const size_t flat_bytes = box->triangles.memory_usage() +
+                              count * bunny->triangles.memory_usage();
+    spdlog::info("{} bunnies as instances: {} KiB of triangles and top level, "
+                 "{} KiB if copied",
+                 count, instanced_scene.memory_usage() / 1024,
+                 flat_bytes / 1024);
+    return true;
+}
 
 /** Offset the ray origin to avoid self-intersection.
     \param[in] ray_pos The original ray origin.
@@ -70,7 +164,7 @@ std::tuple<Vec3f, Vec3f, float> sample_area_light(Vec2f samples) {
     return {pos, normal, pdf};
 }
 
-Vec3f shade_with_light_sampling(Triangle tri, Vec3f p, Vec3f wo) {
+Vec3f shade_with_light_sampling(const Triangle &tri, Vec3f p, Vec3f wo) {
     Vec3f L_dir{0.0f}, L_ind{0.0f};
 
     // Contribution from the light source
@@ -78,11 +172,10 @@ Vec3f shade_with_light_sampling(Triangle tri, Vec3f p, Vec3f wo) {
     Vec3f wi1 = light_pos - p;
     float dist_to_light_squared = normSquared(wi1);
     wi1 = normalize(wi1);
-    const auto [hit1, t1, nearest_tri1] = RayTracer::closest_hit(p, wi1, octree, BoxScene::triangles);
 
     bool tri_contains_lambertian = std::holds_alternative<Lambertian>(BoxScene::materials[tri.material_id]);
 
-    if (is_emitter(nearest_tri1)) {
+    if (unoccluded(p, light_pos)) {
         Vec3f Li = eval_area_light(-wi1);
         float cos = std::max(0.0f, dot(normalize(tri.face_normal), wi1));
         float cos_prime = std::max(dot(-wi1, normalize(light_normal)), 0.0f);
@@ -100,13 +193,14 @@ Vec3f shade_with_light_sampling(Triangle tri, Vec3f p, Vec3f wo) {
     if (tri_contains_lambertian) {
         Lambertian material = std::get<Lambertian>(BoxScene::materials[tri.material_id]);
         const auto [wi2, pdf_wi] = material.sample(tri.face_normal, UniformSampler::next2d());
-        const auto [hit2, t2, nearest_tri2] = RayTracer::closest_hit(p, wi2, octree, BoxScene::triangles);
+        const HitRecord hit2 = trace(p, wi2);
 
         Vec3f fr = material.eval();
 
-        if (hit2 && !is_emitter(nearest_tri2)) {
+        const Triangle nearest_tri2 = hit2.is_hit() ? hit_triangle(hit2) : Triangle{};
+        if (hit2.is_hit() && !is_emitter(nearest_tri2)) {
             float cos = std::max(dot(normalize(tri.face_normal), normalize(wi2)), 0.0f);
-            Vec3f q = offset_ray_origin(p + normalize(wi2) * t2, nearest_tri2.face_normal);
+            Vec3f q = offset_ray_origin(p + normalize(wi2) * hit2.t, nearest_tri2.face_normal);
 
             L_ind = shade_with_light_sampling(nearest_tri2, q, -wi2) * fr * cos / p_rr / pdf_wi;
             // spdlog::info("Lambertian: {}", L_ind);
@@ -114,13 +208,14 @@ Vec3f shade_with_light_sampling(Triangle tri, Vec3f p, Vec3f wo) {
     } else {
         Dielectric material = get<Dielectric>(BoxScene::materials[tri.material_id]);
         const auto [wi2, pdf_wi] = material.sample(wo, tri.face_normal, UniformSampler::next3d());
-        const auto [hit2, t2, nearest_tri2] = RayTracer::closest_hit(p, wi2, octree, BoxScene::triangles);
+        const HitRecord hit2 = trace(p, wi2);
 
         float fr = material.eval(wo, wi2, tri.face_normal);
 
-        if (hit2 && !is_emitter(nearest_tri2) && pdf_wi > 0.0f) {
+        const Triangle nearest_tri2 = hit2.is_hit() ? hit_triangle(hit2) : Triangle{};
+        if (hit2.is_hit() && !is_emitter(nearest_tri2) && pdf_wi > 0.0f) {
             float cos = abs(dot(normalize(tri.face_normal), normalize(wi2)));
-            Vec3f q = offset_ray_origin(p + normalize(wi2) * t2, nearest_tri2.face_normal);
+            Vec3f q = offset_ray_origin(p + normalize(wi2) * hit2.t, nearest_tri2.face_normal);
             L_ind = shade_with_light_sampling(nearest_tri2, q, -wi2) * fr * cos / p_rr / pdf_wi;
             // spdlog::info("Sampled Direction: {}", fr);
             // spdlog::info("L_ind: {}, rec: {}, fr: {}, cos: {}, pdf_wi: {}", L_ind, rec, fr, abs(cos), pdf_wi);
@@ -132,10 +227,10 @@ Vec3f shade_with_light_sampling(Triangle tri, Vec3f p, Vec3f wo) {
 }
 
 Vec3f path_tracing_with_light_sampling(Vec3f ray_pos, Vec3f ray_dir) {
-    const auto [is_ray_hit, t_min, nearest_tri] =
-        RayTracer::closest_hit(ray_pos, ray_dir, octree, BoxScene::triangles);
-    if (!is_ray_hit) return Vec3f{0.0f};
-    const Vec3f hit_position = ray_pos + t_min * ray_dir;
+    const HitRecord hit = trace(ray_pos, ray_dir);
+    if (!hit.is_hit()) return Vec3f{0.0f};
+    const Triangle nearest_tri = hit_triangle(hit);
+    const Vec3f hit_position = ray_pos + hit.t * ray_dir;
     if (is_emitter(nearest_tri)) return eval_area_light(-ray_dir);
 
     return shade_with_light_sampling(nearest_tri, hit_position, -ray_dir);
@@ -158,6 +253,117 @@ void renderRow(int row, int max_spp, const Camera& camera, Image& image) {
         spdlog::info("Finished row {}", row);
 }
 
+/** Fill scene_triangles with the bunny followed by the box. The bunny's
+    mesh becomes the scene's, so only the few box triangles are copied.
+    \param[in] obj_path The bunny.
+    \param[in] bunny_material_id The material of the bunny.
+    \param[in] use_mesh_file Whether to read and write the bunny's mesh file.
+    \return False if the bunny cannot be loaded, which is logged.
+*/
+bool load_scene_triangles(const std::string &obj_path, int bunny_material_id,
+                          bool use_mesh_file) {
+    scene_triangles = load_obj(obj_path, bunny_material_id, use_mesh_file, {},
+                               BoxScene::materials.size());
+    if (scene_triangles.empty()) return false;
+    scene_triangles.append(BoxScene::triangles);
+    return true;
+}
+
+/** Add the bunny to the box scene and build the accelerator over it. With
+    use_cache, both come from a cache file next to the bunny instead when an
+    earlier run built them from the same inputs, which skips parsing the
+    bunny and building; otherwise the cache is written after the build.
+    \param[in] obj_path The bunny.
+    \param[in] bunny_material_id The material of the bunny.
+    \param[in] name The accelerator to build.
+    \param[in] quantize Whether to quantize the accelerator's child bounds.
+    \param[in] use_cache Whether to read and write the cache and the bunny's
+    mesh file.
+    \return False if the bunny cannot be loaded, or the accelerator name is
+    unknown or its build fails, which is logged, true otherwise.
+*/
+bool load_scene(const std::string &obj_path, int bunny_material_id,
+                const std::string &name, bool quantize, bool use_cache) {
+    std::string cache_path;
+    uint64_t key = 0;
+    uint64_t obj_size = 0;
+    int64_t obj_time = 0;
+    if (use_cache && file_stamp(obj_path, obj_size, obj_time)) {
+        // Everything the cached triangles and structure depend on. The bunny
+        // is known by its size and modification time, as reading it all
+        // would cost as much as parsing it, see build_key
+        key = hash_bytes(&obj_size, sizeof(obj_size));
+        key = hash_bytes(&obj_time, sizeof(obj_time), key);
+        key = hash_bytes(BoxScene::triangles.data(),
+                         BoxScene::triangles.size() * sizeof(Triangle), key);
+        key = hash_bytes(&bunny_material_id, sizeof(bunny_material_id), key);
+        key = RayTracer::AcceleratorCache::build_key(name, quantize, key);
+        cache_path =
+            obj_path + "." + name + (quantize ? "-quantized" : "") + ".accel";
+        if (RayTracer::AcceleratorCache::load(cache_path, key,
+                                              scene_triangles, accelerator))
+            return true;
+    }
+
+    if (!load_scene_triangles(obj_path, bunny_material_id, use_cache))
+        return false;
+    if (!RayTracer::build_accelerator(name, scene_triangles, accelerator,
+                                      quantize))
+        return false;
+    if (!cache_path.empty())
+        RayTracer::AcceleratorCache::save(cache_path, key, scene_triangles,
+                                          accelerator);
+    return true;
+}
+
+/** Render one sample per pixel on the calling thread with the octree in
+    breadth-first and in van Emde Boas layout, and log the cache misses and
+    time of each.
+    \param[in] camera The camera to render with.
+    \param[in] width The image width.
+    \param[in] height The image height.
+    \param[in] quantize Whether to quantize the octree's child bounds.
+    \return False if the octree cannot be built, which is logged.
+*/
+bool report_octree_layouts(const Camera &camera, int width, int height,
+                           bool quantize) {
+    CacheMissCounters counters;
+    if (!counters.available())
+        spdlog::warn("Hardware cache counters are unavailable, only timing "
+                     "the layouts");
+    for (bool van_emde_boas : {false, true}) {
+        RayTracer::Octree &octree = accelerator.emplace<RayTracer::Octree>();
+        octree.van_emde_boas_layout = van_emde_boas;
+        octree.quantize_child_boxes = quantize;
+        if (!octree.build_octree(scene_triangles)) return false;
+
+        UniformSampler::init(190);
+        Vec3f sum{0.0f};
+        const auto start = std::chrono::steady_clock::now();
+        counters.start();
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                const Vec3f ray_direction = camera.generate_ray(
+                    (x + 0.5f) / width, 1.0f - (y + 0.5f) / height);
+                sum += path_tracing_with_light_sampling(camera.position,
+                                                        ray_direction);
+            }
+        }
+        counters.stop();
+        const std::chrono::duration<double, std::milli> elapsed =
+            std::chrono::steady_clock::now() - start;
+        const std::string misses =
+            counters.available()
+                ? fmt::format("{} L1D misses, {} LLC misses, ",
+                              counters.l1d_misses, counters.llc_misses)
+                : "";
+        spdlog::info("Octree, {} layout: {}{:.1f} ms (mean radiance {})",
+                     van_emde_boas ? "van Emde Boas" : "breadth-first", misses,
+                     elapsed.count(), sum / float(width * height));
+    }
+    return true;
+}
+
 int main(int argc, char **argv) {
 
 
@@ -194,11 +400,71 @@ int main(int argc, char **argv) {
     // If program can't find the bunny.obj file, use xmake run -w . or move the bunny.obj file to the 
     // same directory as the executable file.
     const std::string obj_path = "./bunny.obj";
-    std::vector<Triangle> obj_triangles = load_obj(obj_path, bunny_material_id);
-    BoxScene::triangles.insert(BoxScene::triangles.end(),
-                               std::make_move_iterator(obj_triangles.begin()),
-                               std::make_move_iterator(obj_triangles.end()));
-    octree.build_octree(BoxScene::triangles);
+    // Pick the acceleration structure with the first argument. Add
+    // "quantized" to store its child bounds in 8 bits, "cache-stats" to
+    // compare the cache misses of the octree layouts instead of rendering,
+    // "bunnies=N" to render N instanced copies of the bunny, "no-cache" to
+    // always parse the bunny and build, see load_scene and load_obj, and
+    // "mailbox-stats" to count the triangle tests the octree's mailbox
+    // saves, e.g. xmake run assignment-4 bvh8 quantized bunnies=16. The
+    // caches only notice a changed bunny by its size and modification time,
+    // so pass "no-cache" once after editing it in place.
+    const std::string accelerator_name = argc > 1 ? argv[1] : "bvh";
+    bool quantize = false;
+    bool cache_stats = false;
+    bool use_cache = true;
+    bool mailbox_stats = false;
+    int num_bunnies = 0;
+    for (int i = 2; i < argc; i++) {
+        const std::string option = argv[i];
+        if (option == "quantized") {
+            quantize = true;
+        } else if (option == "cache-stats") {
+            cache_stats = true;
+        } else if (option == "no-cache") {
+            use_cache = false;
+        } else if (option == "mailbox-stats") {
+            mailbox_stats = true;
+        } else if (option.rfind("bunnies=", 0) == 0 &&
+                   (num_bunnies = std::atoi(option.c_str() + 8)) > 0) {
+            use_instances = true;
+        } else {
+            spdlog::error("Unknown option \"{}\", expected quantized, "
+                          "cache-stats, no-cache, mailbox-stats or bunnies=N",
+                          option);
+            return 1;
+        }
+    }
+    if (cache_stats) {
+        if (accelerator_name != "octree" || use_instances) {
+            spdlog::error("cache-stats compares octree layouts of the flat "
+                          "scene, run it with the octree accelerator and "
+                          "without bunnies=N");
+            return 1;
+        }
+        if (!load_scene_triangles(obj_path, bunny_material_id, use_cache))
+            return 1;
+        return report_octree_layouts(camera, image_width, image_height,
+                                     quantize)
+                   ? 0
+                   : 1;
+    }
+    if (use_instances) {
+        TriangleMesh bunny_triangles =
+            load_obj(obj_path, bunny_material_id, use_cache, {},
+                     BoxScene::materials.size());
+        if (bunny_triangles.empty() ||
+            !build_instanced_scene(accelerator_name, std::move(bunny_triangles),
+                                   num_bunnies, quantize))
+            return 1;
+    } else if (!load_scene(obj_path, bunny_material_id, accelerator_name,
+                           quantize, use_cache)) {
+        return 1;
+    }
+    spdlog::info("Using the {} accelerator", accelerator_name);
+    auto *octree = std::get_if<RayTracer::Octree>(&accelerator);
+    if (use_instances || !mailbox_stats) octree = nullptr;
+    if (octree) octree->count_mailbox_tests = true;
 
     int num_threads = std::thread::hardware_concurrency();
     std::vector<std::thread> threads;
@@ -217,6 +483,7 @@ int main(int argc, char **argv) {
             thread.join();
 
         spdlog::info("Path Tracing with light sampling: Rendering finished!");
+        if (octree) octree->log_mailbox_counters();
         image.save_with_tonemapping("./path_tracing_with_light_sampling" + std::to_string(max_spp) + ".png");
     }
 
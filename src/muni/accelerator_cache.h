@@ -0,0 +1,301 @@
+#pragma once
+#include "common.h"
+#include "mapped_file.h"
+#include "mesh.h"
+#include "ray_tracer.h"
+#include "triangle.h"
+#include <chrono>
+#include <concepts>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace muni { namespace RayTracer {
+
+/** On-disk cache of a built acceleration structure together with the
+    triangles it was built over, which the BVH builds reorder. The file is a
+    header followed by the raw bytes of every array and field, each array
+    aligned to a cache line, so loading is a bulk copy out of a memory
+    mapping with no parsing. Caches are looked up by a key the caller derives
+    from its inputs, which should include build_key. Bump version whenever
+    the fields listed in cache_fields change, or a cached type changes
+    without changing its size.
+*/
+struct AcceleratorCache {
+    static constexpr char magic[8] = {'M', 'U', 'N', 'I', 'A', 'C', 'C', '\0'};
+    static constexpr uint32_t version = 2;
+    static constexpr size_t alignment = 64;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        // Accelerator::index() of the cached structure
+        uint32_t kind;
+        uint64_t key;
+    };
+
+    /** Appends fields and arrays to a byte buffer. */
+    struct Writer {
+        template<typename T> void operator()(const T &value) {
+            static_assert(std::is_trivially_copyable_v<T>,
+                          "cached fields must be memcpy-able");
+            append(&value, sizeof(T));
+        }
+        template<typename T> void operator()(const std::vector<T> &values) {
+            static_assert(std::is_trivially_copyable_v<T>,
+                          "cached arrays must be memcpy-able");
+            const uint64_t count = values.size();
+            append(&count, sizeof(count));
+            bytes.resize((bytes.size() + alignment - 1) / alignment *
+                         alignment);
+            append(values.data(), count * sizeof(T));
+        }
+        void append(const void *data, size_t size) {
+            const uint8_t *begin = static_cast<const uint8_t *>(data);
+            bytes.insert(bytes.end(), begin, begin + size);
+        }
+
+        std::vector<uint8_t> bytes;
+    };
+
+    /** Reads fields and arrays back out of a mapped file, failing instead of
+        reading past its end.
+    */
+    struct Reader {
+        template<typename T> void operator()(T &value) {
+            static_assert(std::is_trivially_copyable_v<T>,
+                          "cached fields must be memcpy-able");
+            read(&value, sizeof(T));
+        }
+        template<typename T> void operator()(std::vector<T> &values) {
+            uint64_t count = 0;
+            read(&count, sizeof(count));
+            position = (position + alignment - 1) / alignment * alignment;
+            if (!ok || count > (size - std::min(position, size)) / sizeof(T)) {
+                ok = false;
+                return;
+            }
+            values.resize(count);
+            read(values.data(), count * sizeof(T));
+        }
+        void read(void *data, size_t num_bytes) {
+            if (!ok || num_bytes > size - std::min(position, size)) {
+                ok = false;
+                return;
+            }
+            std::memcpy(data, bytes + position, num_bytes);
+            position += num_bytes;
+        }
+
+        const uint8_t *bytes;
+        size_t size;
+        size_t position = 0;
+        bool ok = true;
+    };
+
+    template<typename Archive, typename Mesh>
+        requires std::same_as<std::remove_const_t<Mesh>, TriangleMesh>
+    static void cache_fields(Archive &archive, Mesh &mesh) {
+        archive(mesh.vertices);
+        archive(mesh.indices);
+        archive(mesh.material_ids);
+    }
+
+    /** Visit the fields of an octree that a build produces, or that change
+        how it is traversed. Toggles that can be changed at any time keep
+        their defaults.
+    */
+    template<typename Archive, typename Structure>
+        requires std::same_as<std::remove_const_t<Structure>, Octree>
+    static void cache_fields(Archive &archive, Structure &octree) {
+        archive(octree.nodes);
+        archive(octree.child_boxes);
+        archive(octree.quantized_child_boxes);
+        archive(octree.leaf_indices);
+        archive(octree.packed_leaf_indices);
+        archive(octree.leaf_packets);
+        archive(octree.leaf_clip_regions);
+        archive(octree.leaf_triangle_packets);
+        archive(octree.compress_leaf_indices);
+        archive(octree.exact_triangle_overlap);
+        archive(octree.clip_node_bounds);
+        archive(octree.refittable);
+        archive(octree.quantize_child_boxes);
+        archive(octree.van_emde_boas_layout);
+        archive(octree.max_depth);
+        archive(octree.max_leaf_triangles);
+        archive(octree.traversal_cost);
+        archive(octree.intersection_cost);
+        archive(octree.rebuild_threshold);
+        archive(octree.num_leaf_node);
+        archive(octree.num_interior_node);
+        archive(octree.num_total_leaf_triangles);
+        archive(octree.num_child_references);
+        archive(octree.num_box_test_references);
+        archive(octree.leaf_size_histogram);
+        archive(octree.depth_limit);
+        archive(octree.num_build_triangles);
+        archive(octree.build_cost);
+    }
+
+    template<typename Archive, typename Structure>
+        requires std::same_as<std::remove_const_t<Structure>, BVH>
+    static void cache_fields(Archive &archive, Structure &bvh) {
+        archive(bvh.nodes);
+        archive(bvh.num_leaf_node);
+        archive(bvh.num_interior_node);
+        archive(bvh.num_total_leaf_triangles);
+    }
+
+    template<typename Archive, typename Structure>
+        requires(std::same_as<std::remove_const_t<Structure>, BVH4> ||
+                 std::same_as<std::remove_const_t<Structure>, BVH8>)
+    static void cache_fields(Archive &archive, Structure &bvh) {
+        archive(bvh.quantize_bounds);
+        archive(bvh.nodes);
+        archive(bvh.quantized_nodes);
+        archive(bvh.root_frame);
+        archive(bvh.num_leaf_node);
+        archive(bvh.num_interior_node);
+    }
+
+    /** Hash everything a build_accelerator build depends on besides the
+        triangles: the name and quantize, the configuration the structure
+        starts its build with as cache_fields sees it, the builders'
+        constants and the sizes of all cached types. A changed default or
+        node layout then misses the caches written before it. The triangles
+        are up to the caller to hash into seed. When they come from a file
+        known only by its file_stamp, as in the renderer, an edit in place
+        that keeps the size and lands within the file system's timestamp
+        resolution keeps the old key, and the stale cache loads.
+        \param[in] name The accelerator, see build_accelerator.
+        \param[in] quantize Whether its child bounds are quantized.
+        \param[in] seed The hash of the other inputs, see hash_bytes.
+        \return The key.
+    */
+    static uint64_t build_key(const std::string &name, bool quantize,
+                              uint64_t seed) {
+        uint64_t key = hash_bytes(name.data(), name.size(), seed);
+        key = hash_bytes(&quantize, sizeof(quantize), key);
+
+        Accelerator configured;
+        if (configure_accelerator(name, configured, quantize)) {
+            Writer writer;
+            std::visit(
+                [&](const auto &structure) { cache_fields(writer, structure); },
+                configured);
+            key = hash_bytes(writer.bytes.data(), writer.bytes.size(), key);
+        }
+
+        const float constants[] = {float(Octree::max_depth_limit),
+                                   float(BVH::num_bins),
+                                   float(BVH::max_sah_depth),
+                                   float(BVH::max_leaf_triangles),
+                                   float(BVH::lbvh_leaf_triangles),
+                                   BVH::traversal_cost,
+                                   BVH::intersection_cost,
+                                   BVH::min_spatial_split_overlap,
+                                   BVH::default_max_duplication};
+        key = hash_bytes(constants, sizeof(constants), key);
+        const uint64_t sizes[] = {sizeof(Vec3f),
+                                  sizeof(OctreeNode),
+                                  sizeof(OctreeChildBoxes),
+                                  sizeof(QuantizedBoxes<8>),
+                                  sizeof(LeafPacket),
+                                  sizeof(LeafClipRegion),
+                                  sizeof(BVHNode),
+                                  sizeof(BVH4::Node),
+                                  sizeof(BVH4::QuantizedNode),
+                                  sizeof(BVH8::Node),
+                                  sizeof(BVH8::QuantizedNode)};
+        return hash_bytes(sizes, sizeof(sizes), key);
+    }
+
+    /** Write a built structure and its triangles to a cache file, see
+        write_file_atomically.
+        \param[in] path The cache file.
+        \param[in] key The hash of the inputs the structure was built from.
+        \param[in] triangles The triangles, in the order the build left them.
+        \param[in] accelerator The built structure.
+        \return False if the file could not be written.
+    */
+    static bool save(const std::string &path, uint64_t key,
+                     const TriangleMesh &triangles,
+                     const Accelerator &accelerator) {
+        Header header{};
+        std::memcpy(header.magic, magic, sizeof(magic));
+        header.version = version;
+        header.kind = static_cast<uint32_t>(accelerator.index());
+        header.key = key;
+
+        Writer writer;
+        writer(header);
+        cache_fields(writer, triangles);
+        std::visit(
+            [&](const auto &structure) { cache_fields(writer, structure); },
+            accelerator);
+
+        if (!write_file_atomically(path, writer.bytes.data(),
+                                   writer.bytes.size())) {
+            spdlog::warn("Cannot write the accelerator cache {}", path);
+            return false;
+        }
+        spdlog::info("Saved the accelerator cache {} ({:.1f} KiB)", path,
+                     writer.bytes.size() / 1024.0);
+        return true;
+    }
+
+    /** Load a structure and its triangles from a cache file written by save.
+        \param[in] path The cache file.
+        \param[in] key The hash of the inputs the structure must have been
+        built from.
+        \param[out] triangles The triangles, in the order the build left them.
+        \param[out] accelerator The structure.
+        \return False if the file is missing, was written by another version
+        or for other inputs, or is truncated. The outputs are then unchanged.
+    */
+    static bool load(const std::string &path, uint64_t key,
+                     TriangleMesh &triangles,
+                     Accelerator &accelerator) {
+        const auto start = std::chrono::steady_clock::now();
+        MappedFile file;
+        if (!file.open(path)) return false;
+
+        Reader reader{file.data(), file.size()};
+        Header header;
+        reader(header);
+        if (!reader.ok || std::memcmp(header.magic, magic, sizeof(magic)) ||
+            header.version != version || header.key != key) {
+            spdlog::info("Ignoring the stale accelerator cache {}", path);
+            return false;
+        }
+
+        TriangleMesh cached_triangles;
+        cache_fields(reader, cached_triangles);
+        Accelerator cached;
+        switch (header.kind) {
+        case 0: cache_fields(reader, cached.emplace<Octree>()); break;
+        case 1: cache_fields(reader, cached.emplace<BVH>()); break;
+        case 2: cache_fields(reader, cached.emplace<BVH4>()); break;
+        case 3: cache_fields(reader, cached.emplace<BVH8>()); break;
+        default: reader.ok = false;
+        }
+        if (!reader.ok || reader.position != file.size()) {
+            spdlog::warn("Ignoring the corrupt accelerator cache {}", path);
+            return false;
+        }
+        triangles = std::move(cached_triangles);
+        accelerator = std::move(cached);
+
+        const std::chrono::duration<double, std::milli> elapsed =
+            std::chrono::steady_clock::now() - start;
+        spdlog::info("Loaded the accelerator cache {} ({:.1f} KiB) in {:.1f} "
+                     "ms",
+                     path, file.size() / 1024.0, elapsed.count());
+        return true;
+    }
+};
+
+}}  // namespace muni::RayTracer
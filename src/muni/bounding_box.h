@@ -0,0 +1,392 @@
+#pragma once
+#include "common.h"
+#include "ray.h"
+#include "simd.h"
+#include "triangle.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <tuple>
+#include <utility>
+
+namespace muni { namespace RayTracer {
+
+struct BoundingBox3f {
+    BoundingBox3f &include(const Vec3f &point) {
+        min_point = linalg::min(min_point, point);
+        max_point = linalg::max(max_point, point);
+        return *this;
+    }
+
+    BoundingBox3f &include(const BoundingBox3f &other) {
+        min_point = linalg::min(min_point, other.min_point);
+        max_point = linalg::max(max_point, other.max_point);
+        return *this;
+    }
+
+    Vec3f get_center() const { return 0.5f * (min_point + max_point); }
+
+    Vec3f get_corner(int index) const {
+        Vec3f result;
+        for (int i = 0; i < 3; ++i)
+            result[i] = (index & (1 << i)) ? max_point[i] : min_point[i];
+        return result;
+    }
+
+    /** Surface area of the box, the quantity the SAH cost model is built on.
+        An empty (inverted) box has zero area.
+    */
+    float surface_area() const {
+        const Vec3f d = max_point - min_point;
+        if (d.x < 0.f || d.y < 0.f || d.z < 0.f) return 0.f;
+        return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    /** Index of the axis along which the box is widest. */
+    int max_extent_axis() const {
+        const Vec3f d = max_point - min_point;
+        if (d.x > d.y && d.x > d.z) return 0;
+        return d.y > d.z ? 1 : 2;
+    }
+
+    /** A box that contains nothing; including any point makes it valid. */
+    static BoundingBox3f empty() {
+        const float inf = std::numeric_limits<float>::infinity();
+        return BoundingBox3f{Vec3f{inf}, Vec3f{-inf}};
+    }
+
+    static BoundingBox3f from_triangle(const TriangleVertices &tri) {
+        return BoundingBox3f{linalg::min(tri.v0, linalg::min(tri.v1, tri.v2)),
+                             linalg::max(tri.v0, linalg::max(tri.v1, tri.v2))};
+    }
+
+    /** The box both boxes contain, inverted if they do not overlap. */
+    BoundingBox3f intersection(const BoundingBox3f &other) const {
+        return BoundingBox3f{linalg::max(min_point, other.min_point),
+                             linalg::min(max_point, other.max_point)};
+    }
+
+    /** Bounds of the part of a triangle that lies inside this box, found by
+        clipping the triangle against the six planes of the box.
+        \param[in] tri The triangle to clip.
+        \return The clipped bounds, empty if the triangle misses the box.
+    */
+    BoundingBox3f clip_triangle(const TriangleVertices &tri) const {
+        std::array<Vec3f, 9> polygon;
+        std::array<Vec2f, 9> barycentrics;
+        const int num_vertices =
+            clip_triangle_polygon(tri, polygon, barycentrics);
+
+        BoundingBox3f result = empty();
+        for (int i = 0; i < num_vertices; i++) result.include(polygon[i]);
+        if (num_vertices == 0) return result;
+        // Intersection points may round slightly outside the planes
+        result.min_point = linalg::max(result.min_point, min_point);
+        result.max_point = linalg::min(result.max_point, max_point);
+        return result;
+    }
+
+    /** Same as clip_triangle, but bounds the clipped part by the barycentric
+        weights of v1 and v2 of its vertices, which stay valid when the
+        triangle's vertices move. The bounds are grown slightly, so rounding
+        never leaves a gap between the parts of a triangle in neighbouring
+        boxes.
+        \param[in] tri The triangle to clip.
+        \return The smallest and largest weights, min > max if the triangle
+        misses the box.
+    */
+    std::pair<Vec2f, Vec2f>
+    clip_triangle_barycentrics(const TriangleVertices &tri) const {
+        std::array<Vec3f, 9> polygon;
+        std::array<Vec2f, 9> barycentrics;
+        const int num_vertices =
+            clip_triangle_polygon(tri, polygon, barycentrics);
+
+        if (num_vertices == 0) return {Vec2f{1.f}, Vec2f{0.f}};
+        Vec2f uv_min{1.f}, uv_max{0.f};
+        for (int i = 0; i < num_vertices; i++) {
+            uv_min = linalg::min(uv_min, barycentrics[i]);
+            uv_max = linalg::max(uv_max, barycentrics[i]);
+        }
+        constexpr float padding = 1e-5f;
+        return {linalg::max(uv_min - padding, Vec2f{0.f}),
+                linalg::min(uv_max + padding, Vec2f{1.f})};
+    }
+
+    /** Clip a triangle against the six planes of the box, carrying the
+        barycentric weights of v1 and v2 along with every vertex.
+        \param[in] tri The triangle to clip.
+        \param[out] polygon The vertices of the clipped polygon.
+        \param[out] barycentrics The weights of every vertex.
+        \return The number of vertices, 0 if the triangle misses the box.
+    */
+    int clip_triangle_polygon(const TriangleVertices &tri,
+                              std::array<Vec3f, 9> &polygon,
+                              std::array<Vec2f, 9> &barycentrics) const {
+        // Every plane adds at most one vertex, so nine is enough
+        polygon = {tri.v0, tri.v1, tri.v2};
+        barycentrics = {Vec2f{0.f, 0.f}, Vec2f{1.f, 0.f}, Vec2f{0.f, 1.f}};
+        std::array<Vec3f, 9> clipped;
+        std::array<Vec2f, 9> clipped_barycentrics;
+        int num_vertices = 3;
+        for (int axis = 0; axis < 3; axis++) {
+            for (int side = 0; side < 2; side++) {
+                const float plane = side ? max_point[axis] : min_point[axis];
+                auto inside = [&](const Vec3f &p) {
+                    return side ? p[axis] <= plane : p[axis] >= plane;
+                };
+                int num_clipped = 0;
+                for (int i = 0; i < num_vertices; i++) {
+                    const int j = (i + 1) % num_vertices;
+                    const Vec3f &a = polygon[i];
+                    const Vec3f &b = polygon[j];
+                    if (inside(a)) {
+                        clipped_barycentrics[num_clipped] = barycentrics[i];
+                        clipped[num_clipped++] = a;
+                    }
+                    if (inside(a) != inside(b)) {
+                        const float t = (plane - a[axis]) / (b[axis] - a[axis]);
+                        Vec3f p = a + (b - a) * t;
+                        p[axis] = plane;
+                        clipped_barycentrics[num_clipped] =
+                            barycentrics[i] +
+                            (barycentrics[j] - barycentrics[i]) * t;
+                        clipped[num_clipped++] = p;
+                    }
+                }
+                polygon = clipped;
+                barycentrics = clipped_barycentrics;
+                num_vertices = num_clipped;
+                if (num_vertices == 0) return 0;
+            }
+        }
+        return num_vertices;
+    }
+
+    /** Exact triangle/box overlap test by the separating axis theorem
+        (Akenine-Moller, "Fast 3D Triangle-Box Overlap Testing"). The
+        candidate axes are the three box axes, the triangle normal and the
+        nine cross products of box axes and triangle edges. The box is grown
+        by a relative epsilon so rounding never separates a triangle that
+        touches it.
+        \param[in] tri The triangle to test.
+        \return True if the triangle and the box overlap.
+    */
+    bool overlaps_triangle(const TriangleVertices &tri) const {
+        const Vec3f center = get_center();
+        const Vec3f half = 0.5f * (max_point - min_point) * (1.f + 1e-5f) +
+                           Vec3f{1e-9f};
+        const Vec3f v[3] = {tri.v0 - center, tri.v1 - center, tri.v2 - center};
+
+        // Box axes, which is the AABB test
+        const Vec3f tri_min = linalg::min(v[0], linalg::min(v[1], v[2]));
+        const Vec3f tri_max = linalg::max(v[0], linalg::max(v[1], v[2]));
+        for (int i = 0; i < 3; i++) {
+            if (tri_min[i] > half[i] || tri_max[i] < -half[i]) return false;
+        }
+
+        auto separated = [&](const Vec3f &axis) {
+            const float p0 = dot(axis, v[0]);
+            const float p1 = dot(axis, v[1]);
+            const float p2 = dot(axis, v[2]);
+            const float r = half.x * std::abs(axis.x) +
+                            half.y * std::abs(axis.y) +
+                            half.z * std::abs(axis.z);
+            return std::min({p0, p1, p2}) > r || std::max({p0, p1, p2}) < -r;
+        };
+
+        // Triangle normal
+        const Vec3f edges[3] = {v[1] - v[0], v[2] - v[1], v[0] - v[2]};
+        if (separated(cross(edges[0], edges[1]))) return false;
+
+        // Box axis x triangle edge
+        for (const Vec3f &e : edges) {
+            if (separated(Vec3f{0.f, -e.z, e.y}) ||
+                separated(Vec3f{e.z, 0.f, -e.x}) ||
+                separated(Vec3f{-e.y, e.x, 0.f}))
+                return false;
+        }
+        return true;
+    }
+
+    bool bounds_overlap_triangle(const TriangleVertices &tri) const {
+        Vec3f tri_min = linalg::min(tri.v0, linalg::min(tri.v1, tri.v2));
+        Vec3f tri_max = linalg::max(tri.v0, linalg::max(tri.v1, tri.v2));
+        return (tri_min.x <= max_point.x && tri_max.x >= min_point.x &&
+                tri_min.y <= max_point.y && tri_max.y >= min_point.y &&
+                tri_min.z <= max_point.z && tri_max.z >= min_point.z);
+    }
+
+    /** Slab test against a ray, using its precomputed inverse direction and
+        direction signs to pick the entry and exit plane of every slab.
+        \return A tuple containing a boolean indicating whether the ray hits
+        the box, and the entry and exit t values (the entry clamped to 0).
+    */
+    std::tuple<bool, float, float> ray_intersect(const Ray &ray) const {
+        const Vec3f &inv_dir = ray.inv_direction;
+        float t_near = 0.f;
+        float t_far = std::numeric_limits<float>::infinity();
+        for (int i = 0; i < 3; i++) {
+            const float lo = ray.dir_is_neg[i] ? max_point[i] : min_point[i];
+            const float hi = ray.dir_is_neg[i] ? min_point[i] : max_point[i];
+            // fmax/fmin drop the NaN produced by 0 * inf on a parallel slab
+            t_near = std::fmax(t_near, (lo - ray.origin[i]) * inv_dir[i]);
+            t_far = std::fmin(t_far, (hi - ray.origin[i]) * inv_dir[i]);
+        }
+        return {t_near <= t_far, t_near, t_far};
+    }
+
+    Vec3f min_point;
+    Vec3f max_point;
+};
+
+/** Slab test a ray against N boxes stored structure-of-arrays, all at once.
+    Boxes with inverted infinite bounds are never hit.
+    \param[in] bounds_min bounds_min[axis][box], the box minima.
+    \param[in] bounds_max bounds_max[axis][box], the box maxima.
+    \param[in] ray The ray, with its traversal data precomputed.
+    \param[in] t_max The maximum t value to consider.
+    \param[out] t_near The entry distance of every box.
+    \return A bit mask of the boxes the ray hits.
+*/
+template<int N>
+int ray_intersect_boxes(const float (&bounds_min)[3][N],
+                        const float (&bounds_max)[3][N], const Ray &ray,
+                        float t_max, float *t_near) {
+    using vf = simd::vfloat<N>;
+    vf t_enter = vf::broadcast(0.f);
+    vf t_exit = vf::broadcast(t_max);
+    for (int axis = 0; axis < 3; axis++) {
+        // The direction sign is the same for every box, so the near and far
+        // planes are picked per axis, not per lane
+        const float *near_plane =
+            ray.dir_is_neg[axis] ? bounds_max[axis] : bounds_min[axis];
+        const float *far_plane =
+            ray.dir_is_neg[axis] ? bounds_min[axis] : bounds_max[axis];
+        const vf origin = vf::broadcast(ray.origin[axis]);
+        const vf inv_dir = vf::broadcast(ray.inv_direction[axis]);
+        // The running value goes first, so a NaN from 0 * inf is dropped
+        t_enter = max(t_enter, (vf::load(near_plane) - origin) * inv_dir);
+        t_exit = min(t_exit, (vf::load(far_plane) - origin) * inv_dir);
+    }
+    t_enter.store(t_near);
+    return (t_enter <= t_exit).movemask();
+}
+
+/** N boxes stored as 8-bit offsets inside a frame box, usually the bounds of
+    their parent node, at a quarter of the size of float bounds. Every
+    quantized box is rounded outward, so it contains the box it was made
+    from and a ray can only ever hit more of them, never fewer.
+*/
+template<int N> struct QuantizedBoxes {
+    static_assert(N <= 8, "the valid lanes are stored in 8 bits");
+
+    // The frame is split into 254 steps per axis, so the spare 255th step
+    // absorbs any rounding of the frame's maximum
+    static constexpr float num_steps = 254.f;
+
+    /** Size of one quantization step along every axis of a frame. */
+    static Vec3f step_size(const BoundingBox3f &frame) {
+        return (frame.max_point - frame.min_point) * (1.f / num_steps);
+    }
+
+    /** Boxes with no valid lanes. */
+    static QuantizedBoxes empty() {
+        QuantizedBoxes boxes;
+        for (int axis = 0; axis < 3; axis++) {
+            for (int lane = 0; lane < N; lane++)
+                boxes.q_min[axis][lane] = boxes.q_max[axis][lane] = 0;
+        }
+        boxes.valid_mask = 0;
+        return boxes;
+    }
+
+    /** Quantize a box into a lane, rounding outward.
+        \param[in] frame The frame the offsets are relative to.
+        \param[in] lane The lane to store the box in.
+        \param[in] box The box, which has to lie inside the frame.
+    */
+    void set(const BoundingBox3f &frame, int lane, const BoundingBox3f &box) {
+        const Vec3f step = step_size(frame);
+        for (int axis = 0; axis < 3; axis++) {
+            const float origin = frame.min_point[axis];
+            int lo = 0, hi = 0;
+            if (step[axis] > 0.f) {
+                lo = std::clamp(static_cast<int>(std::floor(
+                                    (box.min_point[axis] - origin) / step[axis])),
+                                0, 255);
+                hi = std::clamp(static_cast<int>(std::ceil(
+                                    (box.max_point[axis] - origin) / step[axis])),
+                                0, 255);
+                // Fix up the rounding of the divisions with the exact
+                // expression intersect uses
+                while (lo > 0 &&
+                       origin + float(lo) * step[axis] > box.min_point[axis])
+                    lo--;
+                while (hi < 255 &&
+                       origin + float(hi) * step[axis] < box.max_point[axis])
+                    hi++;
+            }
+            q_min[axis][lane] = static_cast<uint8_t>(lo);
+            q_max[axis][lane] = static_cast<uint8_t>(hi);
+        }
+        valid_mask |= 1u << lane;
+    }
+
+    /** The box a lane dequantizes to, exactly as ray_intersect tests it, so
+        it contains the box set stored in the lane.
+        \param[in] frame The frame the boxes were quantized in.
+        \param[in] lane The lane.
+        \return The box.
+    */
+    BoundingBox3f get(const BoundingBox3f &frame, int lane) const {
+        const Vec3f step = step_size(frame);
+        BoundingBox3f box;
+        for (int axis = 0; axis < 3; axis++) {
+            box.min_point[axis] =
+                frame.min_point[axis] + float(q_min[axis][lane]) * step[axis];
+            box.max_point[axis] =
+                frame.min_point[axis] + float(q_max[axis][lane]) * step[axis];
+        }
+        return box;
+    }
+
+    /** Slab test a ray against all valid lanes at once, see
+        ray_intersect_boxes.
+        \param[in] frame The frame the boxes were quantized in.
+    */
+    int ray_intersect(const BoundingBox3f &frame, const Ray &ray, float t_max,
+                      float *t_near) const {
+        using vf = simd::vfloat<N>;
+        const Vec3f step = step_size(frame);
+        vf t_enter = vf::broadcast(0.f);
+        vf t_exit = vf::broadcast(t_max);
+        for (int axis = 0; axis < 3; axis++) {
+            const uint8_t *near_plane =
+                ray.dir_is_neg[axis] ? q_max[axis] : q_min[axis];
+            const uint8_t *far_plane =
+                ray.dir_is_neg[axis] ? q_min[axis] : q_max[axis];
+            const vf origin = vf::broadcast(frame.min_point[axis]);
+            const vf step_axis = vf::broadcast(step[axis]);
+            const vf ray_origin = vf::broadcast(ray.origin[axis]);
+            const vf inv_dir = vf::broadcast(ray.inv_direction[axis]);
+            // Dequantize exactly like set checks the rounding
+            const vf near_bound = origin + vf::load_bytes(near_plane) * step_axis;
+            const vf far_bound = origin + vf::load_bytes(far_plane) * step_axis;
+            t_enter = max(t_enter, (near_bound - ray_origin) * inv_dir);
+            t_exit = min(t_exit, (far_bound - ray_origin) * inv_dir);
+        }
+        t_enter.store(t_near);
+        return (t_enter <= t_exit).movemask() & valid_mask;
+    }
+
+    // q_min[axis][lane], q_max[axis][lane]
+    uint8_t q_min[3][N];
+    uint8_t q_max[3][N];
+    // Bit i is set if lane i holds a box
+    uint8_t valid_mask;
+};
+
+}}  // namespace muni::RayTracer
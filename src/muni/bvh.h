@@ -0,0 +1,879 @@
+#pragma once
+#include "common.h"
+#include "bounding_box.h"
+#include "mesh.h"
+#include "morton.h"
+#include "parallel.h"
+#include "triangle.h"
+#include "math_helpers.h"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <future>
+#include <limits>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace muni { namespace RayTracer {
+
+/** A node of the flattened BVH. Nodes are stored depth-first in one array, so
+    the first child of an interior node always directly follows its parent and
+    only the second child needs an explicit index.
+*/
+struct BVHNode {
+    BoundingBox3f bounds;
+    // Leaf: index of the first triangle. Interior: index of the second child.
+    uint32_t offset;
+    // Zero for interior nodes.
+    uint16_t num_triangles;
+    // Axis the interior node was split along, used to pick the near child.
+    uint8_t split_axis;
+    uint8_t padding;
+
+    bool is_leaf() const { return num_triangles > 0; }
+};
+static_assert(sizeof(BVHNode) == 32, "BVHNode should fill half a cache line");
+
+struct BVH {
+    /** Traverse the BVH front to back, shrinking the search interval every
+        time a closer triangle is found.
+        \param[in] triangles The triangles the BVH was built over.
+        \param[in] ray The ray, with its traversal data precomputed.
+        \param[in] t_max The maximum t value to consider.
+        \return The closest hit, if any.
+    */
+    HitRecord bvh_traversal(const TriangleMesh &triangles,
+                            const Ray &ray, const float t_max) const {
+        HitRecord rec;
+        rec.t = t_max;
+        if (nodes.empty()) return rec;
+
+        uint32_t stack[max_stack_depth];
+        int stack_size = 0;
+        uint32_t node_idx = 0;
+        while (true) {
+            const BVHNode &node = nodes[node_idx];
+            auto [hit, t_near, t_far] = node.bounds.ray_intersect(ray);
+            if (hit && t_near <= rec.t) {
+                if (node.is_leaf()) {
+                    for (uint32_t i = node.offset;
+                         i < node.offset + node.num_triangles; i++) {
+                        auto [hit, t, barycentrics] =
+                            Triangle::ray_triangle_intersect(
+                                triangles[i], ray, EPS, rec.t);
+                        if (hit) rec = HitRecord{t, i, barycentrics};
+                    }
+                } else {
+                    // Visit the child on the ray's side of the split first
+                    if (ray.dir_is_neg[node.split_axis]) {
+                        stack[stack_size++] = node_idx + 1;
+                        node_idx = node.offset;
+                    } else {
+                        stack[stack_size++] = node.offset;
+                        node_idx = node_idx + 1;
+                    }
+                    continue;
+                }
+            }
+            if (stack_size == 0) break;
+            node_idx = stack[--stack_size];
+        }
+        return rec;
+    }
+
+    /** Check whether anything blocks the ray before t_max - ANYHIT_EPS. Returns
+        on the first blocker, without ordering children or tracking hits.
+        \param[in] triangles The triangles the BVH was built over.
+        \param[in] ray The ray, with its traversal data precomputed.
+        \param[in] t_max The distance to the target point.
+        \return True if the ray is blocked, false otherwise.
+    */
+    bool bvh_occluded(const TriangleMesh &triangles, const Ray &ray,
+                      const float t_max) const {
+        if (nodes.empty()) return false;
+
+        const float t_limit = t_max - ANYHIT_EPS;
+        uint32_t stack[max_stack_depth];
+        int stack_size = 0;
+        uint32_t node_idx = 0;
+        while (true) {
+            const BVHNode &node = nodes[node_idx];
+            auto [hit, t_near, t_far] = node.bounds.ray_intersect(ray);
+            if (hit && t_near <= t_limit) {
+                if (node.is_leaf()) {
+                    for (uint32_t i = node.offset;
+                         i < node.offset + node.num_triangles; i++) {
+                        if (std::get<0>(Triangle::ray_triangle_intersect(
+                                triangles[i], ray, EPS, t_limit)))
+                            return true;
+                    }
+                } else {
+                    stack[stack_size++] = node.offset;
+                    node_idx = node_idx + 1;
+                    continue;
+                }
+            }
+            if (stack_size == 0) return false;
+            node_idx = stack[--stack_size];
+        }
+    }
+
+    /** Build the BVH over a list of triangles with the binned surface area
+        heuristic. The triangles are reordered in place so that every leaf
+        references a contiguous range of them. The top levels bin their
+        primitives on all cores, and below them subtrees are built as parallel
+        tasks; the result is the same as a single threaded build.
+        \param[in,out] triangles The triangles to build over.
+    */
+    void build_bvh(TriangleMesh &triangles) {
+        const auto start = std::chrono::steady_clock::now();
+        std::vector<BVHPrimitive> primitives = begin_build(triangles);
+        if (primitives.empty()) return;
+
+        nodes.reserve(2 * triangles.size());
+        build(primitives, 0, static_cast<uint32_t>(primitives.size()), 0);
+        finish_build(triangles, primitives, "BVH", start);
+    }
+
+    /** Build a linear BVH: sort the triangles along a 63-bit Morton curve
+        through their centroids with a parallel radix sort, then split every
+        range where the codes of its first and last triangle first differ.
+        This builds many times faster than build_bvh but ignores the surface
+        area, so rays take somewhat longer to trace. The triangles are
+        reordered in place as with build_bvh.
+        \param[in,out] triangles The triangles to build over.
+    */
+    void build_lbvh(TriangleMesh &triangles) {
+        const auto start = std::chrono::steady_clock::now();
+        std::vector<BVHPrimitive> primitives = begin_build(triangles);
+        if (primitives.empty()) return;
+        const uint32_t num_triangles = static_cast<uint32_t>(primitives.size());
+
+        const BoundingBox3f centroid_bounds =
+            fold_range<RangeBounds>(
+                0, num_triangles, true,
+                [&](RangeBounds &partial, uint32_t i) {
+                    partial.centroid_bounds.include(primitives[i].centroid);
+                },
+                [](RangeBounds &partial, const RangeBounds &other) {
+                    partial.centroid_bounds.include(other.centroid_bounds);
+                })
+                .centroid_bounds;
+
+        // Quantize the centroids to 21 bits per axis and sort by Morton code
+        constexpr float grid_max = float((1 << 21) - 1);
+        const Vec3f extent =
+            centroid_bounds.max_point - centroid_bounds.min_point;
+        Vec3f scale;
+        for (int axis = 0; axis < 3; axis++)
+            scale[axis] = extent[axis] > 0.f ? grid_max / extent[axis] : 0.f;
+        std::vector<uint64_t> codes(num_triangles);
+        std::vector<uint32_t> order(num_triangles);
+        parallel_chunks(
+            0, num_triangles, min_parallel_primitives,
+            [&](unsigned int, uint32_t begin, uint32_t end) {
+                for (uint32_t i = begin; i < end; i++) {
+                    const Vec3f grid = (primitives[i].centroid -
+                                        centroid_bounds.min_point) * scale;
+                    codes[i] = morton_encode_63(
+                        static_cast<uint32_t>(std::min(grid.x, grid_max)),
+                        static_cast<uint32_t>(std::min(grid.y, grid_max)),
+                        static_cast<uint32_t>(std::min(grid.z, grid_max)));
+                    order[i] = i;
+                }
+            });
+        radix_sort(codes, order);
+
+        std::vector<BVHPrimitive> sorted_primitives(num_triangles);
+        parallel_chunks(0, num_triangles, min_parallel_primitives,
+                        [&](unsigned int, uint32_t begin, uint32_t end) {
+                            for (uint32_t i = begin; i < end; i++)
+                                sorted_primitives[i] = primitives[order[i]];
+                        });
+
+        nodes.reserve(2 * num_triangles / lbvh_leaf_triangles + 1);
+        build_linear(sorted_primitives, codes, 0, num_triangles, 0);
+        finish_build(triangles, sorted_primitives, "LBVH", start);
+    }
+
+    /** Build a spatial split BVH (SBVH). Besides the object splits of
+        build_bvh, every node also considers spatial splits, which cut the
+        triangles straddling the split plane in two and put a reference to
+        each part, clipped to its side, into both children. This keeps long
+        triangles such as the walls of the box from inflating every node they
+        cross. Spatial splits are only tried where the object split children
+        overlap noticeably, and stop once the duplicated references reach
+        max_duplication times the triangle count.
+        Leaves reference contiguous triangle ranges as with build_bvh, so
+        triangles is rewritten in leaf order and repeats a face for every
+        duplicated reference. Only the face's indices are repeated, not its
+        vertices.
+        \param[in,out] triangles The triangles to build over.
+        \param[in] max_duplication The budget of extra references, relative
+        to the number of triangles.
+    */
+    void build_sbvh(TriangleMesh &triangles,
+                    float max_duplication = default_max_duplication) {
+        const auto start = std::chrono::steady_clock::now();
+        std::vector<BVHPrimitive> primitives = begin_build(triangles);
+        if (primitives.empty()) return;
+        const uint32_t num_triangles = static_cast<uint32_t>(primitives.size());
+
+        BoundingBox3f bounds = BoundingBox3f::empty();
+        for (const BVHPrimitive &prim : primitives) bounds.include(prim.bounds);
+        SpatialSplitBuild state{
+            triangles, {}, bounds.surface_area(),
+            static_cast<uint32_t>(max_duplication * num_triangles)};
+        state.leaf_order.reserve(num_triangles + state.remaining_duplicates);
+        nodes.reserve(2 * num_triangles);
+        build_spatial(std::move(primitives), bounds, 0, state);
+
+        const size_t num_references = state.leaf_order.size();
+        spdlog::info("SBVH: {} references to {} triangles ({:.1f}% "
+                     "duplicated)",
+                     num_references, num_triangles,
+                     100.0 * (num_references - num_triangles) / num_triangles);
+        finish_build(triangles, state.leaf_order, "SBVH", start);
+    }
+
+    BVH() {}
+    BVH(TriangleMesh &triangles) { build_bvh(triangles); }
+
+    struct BVHPrimitive {
+        BoundingBox3f bounds;
+        Vec3f centroid;
+        uint32_t triangle_idx;
+    };
+
+    static constexpr int num_bins = 16;
+    static constexpr int max_stack_depth = 64;
+    // Below this depth splits fall back to the object median, which bounds the
+    // tree depth by max_sah_depth + log2(#triangles) < max_stack_depth.
+    static constexpr int max_sah_depth = 32;
+    static constexpr uint32_t max_leaf_triangles = 8;
+    // Ranges of at most this many triangles become leaves in build_lbvh
+    static constexpr uint32_t lbvh_leaf_triangles = 4;
+    static constexpr float traversal_cost = 1.f;
+    static constexpr float intersection_cost = 1.f;
+    // Ranges smaller than this are binned on one thread
+    static constexpr uint32_t min_parallel_primitives = 1 << 14;
+    // Subtrees smaller than this are not worth a task of their own
+    static constexpr uint32_t min_task_primitives = 1 << 10;
+    // build_sbvh tries spatial splits where the object split children overlap
+    // by more than this fraction of the root's surface area. The SBVH paper
+    // uses 1e-5; on the box scene 1e-3 traces as fast and builds 5x faster.
+    static constexpr float min_spatial_split_overlap = 1e-3f;
+    // The budget build_sbvh duplicates references within by default
+    static constexpr float default_max_duplication = 0.3f;
+
+    std::vector<BVHNode> nodes;
+    uint32_t num_leaf_node = 0;
+    uint32_t num_interior_node = 0;
+    uint32_t num_total_leaf_triangles = 0;
+
+private:
+    struct RangeBounds {
+        BoundingBox3f bounds = BoundingBox3f::empty();
+        BoundingBox3f centroid_bounds = BoundingBox3f::empty();
+    };
+
+    struct Bins {
+        std::array<BoundingBox3f, num_bins> bounds;
+        std::array<uint32_t, num_bins> counts{};
+
+        Bins() { bounds.fill(BoundingBox3f::empty()); }
+    };
+
+    /** Fold the primitives in [begin, end) into a T. With parallel set, every
+        thread folds one chunk and the partial results are combined in order.
+    */
+    template<typename T, typename Accumulate, typename Combine>
+    static T fold_range(uint32_t begin, uint32_t end, bool parallel,
+                        Accumulate accumulate, Combine combine) {
+        if (!parallel) {
+            T result;
+            for (uint32_t i = begin; i < end; i++) accumulate(result, i);
+            return result;
+        }
+        std::vector<T> partial(num_worker_threads());
+        const unsigned int num_chunks = parallel_chunks(
+            begin, end, min_parallel_primitives,
+            [&](unsigned int chunk, uint32_t chunk_begin, uint32_t chunk_end) {
+                for (uint32_t i = chunk_begin; i < chunk_end; i++)
+                    accumulate(partial[chunk], i);
+            });
+        for (unsigned int chunk = 1; chunk < num_chunks; chunk++)
+            combine(partial[0], partial[chunk]);
+        return partial[0];
+    }
+
+    /** Reset the BVH and compute the bounds and centroid of every triangle.
+        \return One primitive per triangle, in input order.
+    */
+    std::vector<BVHPrimitive>
+    begin_build(const TriangleMesh &triangles) {
+        nodes.clear();
+        num_leaf_node = num_interior_node = num_total_leaf_triangles = 0;
+        // Enough subtrees to keep every core busy exist below parallel_depth
+        parallel_depth =
+            static_cast<int>(std::bit_width(num_worker_threads() - 1));
+
+        const uint32_t num_triangles = static_cast<uint32_t>(triangles.size());
+        std::vector<BVHPrimitive> primitives(num_triangles);
+        parallel_chunks(0, num_triangles, min_parallel_primitives,
+                        [&](unsigned int, uint32_t begin, uint32_t end) {
+                            for (uint32_t i = begin; i < end; i++) {
+                                primitives[i].bounds =
+                                    BoundingBox3f::from_triangle(triangles[i]);
+                                primitives[i].centroid =
+                                    primitives[i].bounds.get_center();
+                                primitives[i].triangle_idx = i;
+                            }
+                        });
+        return primitives;
+    }
+
+    /** Reorder the triangles into leaf order and report the build. A
+        triangle referenced by several primitives is repeated once for each,
+        which only repeats its indices and material.
+    */
+    void finish_build(TriangleMesh &triangles,
+                      const std::vector<BVHPrimitive> &primitives,
+                      const char *builder,
+                      std::chrono::steady_clock::time_point start) {
+        const uint32_t num_triangles = static_cast<uint32_t>(primitives.size());
+        std::vector<uint32_t> order(num_triangles);
+        parallel_chunks(0, num_triangles, min_parallel_primitives,
+                        [&](unsigned int, uint32_t begin, uint32_t end) {
+                            for (uint32_t i = begin; i < end; i++)
+                                order[i] = primitives[i].triangle_idx;
+                        });
+        triangles.reorder(order);
+
+        const std::chrono::duration<double, std::milli> elapsed =
+            std::chrono::steady_clock::now() - start;
+        spdlog::info("{}: {} nodes, {} leaves, built in {:.1f} ms on {} "
+                     "threads",
+                     builder, nodes.size(), num_leaf_node, elapsed.count(),
+                     num_worker_threads());
+    }
+
+    struct SpatialSplitBuild {
+        const TriangleMesh &triangles;
+        // References in leaf order, their bounds clipped to their leaf
+        std::vector<BVHPrimitive> leaf_order;
+        float root_area;
+        uint32_t remaining_duplicates;
+    };
+
+    struct SplitCandidate {
+        float cost = std::numeric_limits<float>::infinity();
+        int axis = -1;
+        // The first bin of the right child, and where its lower plane lies
+        int plane = 0;
+        float position = 0.f;
+        BoundingBox3f left_bounds = BoundingBox3f::empty();
+        BoundingBox3f right_bounds = BoundingBox3f::empty();
+
+        bool valid() const { return axis >= 0; }
+    };
+
+    /** Best binned SAH object split of the references over all three axes. */
+    static SplitCandidate
+    find_object_split(const std::vector<BVHPrimitive> &refs) {
+        BoundingBox3f centroid_bounds = BoundingBox3f::empty();
+        for (const BVHPrimitive &ref : refs)
+            centroid_bounds.include(ref.centroid);
+
+        SplitCandidate best;
+        for (int axis = 0; axis < 3; axis++) {
+            const float axis_min = centroid_bounds.min_point[axis];
+            const float axis_extent = centroid_bounds.max_point[axis] - axis_min;
+            if (axis_extent <= 0.f) continue;
+            const float scale = num_bins / axis_extent;
+            Bins bins;
+            for (const BVHPrimitive &ref : refs) {
+                const int b = std::min(
+                    static_cast<int>((ref.centroid[axis] - axis_min) * scale),
+                    num_bins - 1);
+                bins.counts[b]++;
+                bins.bounds[b].include(ref.bounds);
+            }
+            sweep_bins(bins, bins.counts, bins.counts, axis,
+                       [&](int b) { return axis_min + b / scale; }, best);
+        }
+        return best;
+    }
+
+    /** Best binned spatial split of the references over all three axes. A
+        reference is clipped to every bin it overlaps; it counts towards the
+        left side from the bin it enters and the right side from the bin it
+        exits, so straddling references count on both.
+    */
+    static SplitCandidate
+    find_spatial_split(const std::vector<BVHPrimitive> &refs,
+                       const BoundingBox3f &bounds,
+                       const SpatialSplitBuild &state) {
+        SplitCandidate best;
+        for (int axis = 0; axis < 3; axis++) {
+            const float axis_min = bounds.min_point[axis];
+            const float axis_extent = bounds.max_point[axis] - axis_min;
+            if (axis_extent <= 0.f) continue;
+            const float bin_width = axis_extent / num_bins;
+            auto plane_of = [&](int b) { return axis_min + b * bin_width; };
+            auto bin_of = [&](float x) {
+                return std::clamp(static_cast<int>((x - axis_min) / bin_width),
+                                  0, num_bins - 1);
+            };
+
+            Bins bins;
+            std::array<uint32_t, num_bins> entry_counts{}, exit_counts{};
+            for (const BVHPrimitive &ref : refs) {
+                const int first = bin_of(ref.bounds.min_point[axis]);
+                const int last = std::max(bin_of(ref.bounds.max_point[axis]),
+                                          first);
+                entry_counts[first]++;
+                exit_counts[last]++;
+                // Chop the reference into one piece per bin it overlaps
+                BVHPrimitive rest = ref;
+                for (int b = first; b < last; b++) {
+                    auto [piece, remainder] =
+                        split_reference(rest, axis, plane_of(b + 1), state);
+                    bins.bounds[b].include(piece);
+                    rest.bounds = remainder;
+                }
+                bins.bounds[last].include(rest.bounds);
+            }
+
+            // Only planes whose duplicates fit in the budget are candidates
+            SplitCandidate axis_best;
+            sweep_bins(bins, entry_counts, exit_counts, axis, plane_of,
+                       axis_best,
+                       [&](uint32_t left_count, uint32_t right_count) {
+                           return left_count + right_count - refs.size() <=
+                                  state.remaining_duplicates;
+                       });
+            if (axis_best.cost < best.cost) best = axis_best;
+        }
+        return best;
+    }
+
+    /** Evaluate the num_bins - 1 planes between the bins and keep the
+        cheapest one in best if it beats it. left_counts[b] counts what starts
+        in bin b and right_counts[b] what ends there.
+    */
+    template<typename PlaneOf, typename Accept = std::nullptr_t>
+    static void sweep_bins(const Bins &bins,
+                           const std::array<uint32_t, num_bins> &left_counts,
+                           const std::array<uint32_t, num_bins> &right_counts,
+                           int axis, PlaneOf plane_of, SplitCandidate &best,
+                           Accept accept = nullptr) {
+        std::array<BoundingBox3f, num_bins> right_boxes;
+        std::array<uint32_t, num_bins> right_sums;
+        BoundingBox3f right_box = BoundingBox3f::empty();
+        uint32_t right_sum = 0;
+        for (int b = num_bins - 1; b > 0; b--) {
+            right_box.include(bins.bounds[b]);
+            right_sum += right_counts[b];
+            right_boxes[b] = right_box;
+            right_sums[b] = right_sum;
+        }
+        BoundingBox3f left_box = BoundingBox3f::empty();
+        uint32_t left_sum = 0;
+        for (int b = 1; b < num_bins; b++) {
+            left_box.include(bins.bounds[b - 1]);
+            left_sum += left_counts[b - 1];
+            if (left_sum == 0 || right_sums[b] == 0) continue;
+            if constexpr (!std::is_same_v<Accept, std::nullptr_t>) {
+                if (!accept(left_sum, right_sums[b])) continue;
+            }
+            const float cost = left_box.surface_area() * left_sum +
+                               right_boxes[b].surface_area() * right_sums[b];
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = axis;
+                best.plane = b;
+                best.position = plane_of(b);
+                best.left_bounds = left_box;
+                best.right_bounds = right_boxes[b];
+            }
+        }
+    }
+
+    /** Split a reference at a plane. The triangle's vertices go to their
+        side, and the points where its edges cross the plane to both; each
+        side is then clipped to the reference's bounds.
+        \return The bounds of the part left and right of the plane.
+    */
+    static std::pair<BoundingBox3f, BoundingBox3f>
+    split_reference(const BVHPrimitive &ref, int axis, float position,
+                    const SpatialSplitBuild &state) {
+        const TriangleVertices tri = state.triangles[ref.triangle_idx];
+        const Vec3f vertices[3] = {tri.v0, tri.v1, tri.v2};
+        BoundingBox3f left = BoundingBox3f::empty();
+        BoundingBox3f right = BoundingBox3f::empty();
+        for (int i = 0; i < 3; i++) {
+            const Vec3f &a = vertices[i];
+            const Vec3f &b = vertices[(i + 1) % 3];
+            if (a[axis] <= position) left.include(a);
+            if (a[axis] >= position) right.include(a);
+            if ((a[axis] < position && b[axis] > position) ||
+                (a[axis] > position && b[axis] < position)) {
+                const float t = (position - a[axis]) / (b[axis] - a[axis]);
+                Vec3f p = a + (b - a) * t;
+                p[axis] = position;
+                left.include(p);
+                right.include(p);
+            }
+        }
+        BoundingBox3f left_slab = ref.bounds, right_slab = ref.bounds;
+        left_slab.max_point[axis] = position;
+        right_slab.min_point[axis] = position;
+        return {left.intersection(left_slab), right.intersection(right_slab)};
+    }
+
+    uint32_t build_spatial(std::vector<BVHPrimitive> refs,
+                           const BoundingBox3f &bounds, int depth,
+                           SpatialSplitBuild &state) {
+        const uint32_t count = static_cast<uint32_t>(refs.size());
+        auto make_spatial_leaf = [&]() {
+            const uint32_t begin =
+                static_cast<uint32_t>(state.leaf_order.size());
+            state.leaf_order.insert(state.leaf_order.end(), refs.begin(),
+                                    refs.end());
+            return make_leaf(bounds, begin, begin + count);
+        };
+        if (count == 1) return make_spatial_leaf();
+
+        std::vector<BVHPrimitive> left, right;
+        SplitCandidate split;
+        bool spatial = false;
+        if (depth < max_sah_depth) {
+            split = find_object_split(refs);
+            const float overlap = split.valid()
+                                      ? split.left_bounds
+                                            .intersection(split.right_bounds)
+                                            .surface_area()
+                                      : std::numeric_limits<float>::infinity();
+            if (state.remaining_duplicates > 0 &&
+                overlap > min_spatial_split_overlap * state.root_area) {
+                const SplitCandidate spatial_split =
+                    find_spatial_split(refs, bounds, state);
+                if (spatial_split.cost < split.cost) {
+                    split = spatial_split;
+                    spatial = true;
+                }
+            }
+
+            const float split_cost =
+                traversal_cost +
+                intersection_cost * split.cost / bounds.surface_area();
+            const float leaf_cost = intersection_cost * count;
+            if (count <= max_leaf_triangles &&
+                (!split.valid() || split_cost >= leaf_cost))
+                return make_spatial_leaf();
+        }
+
+        if (spatial) {
+            for (const BVHPrimitive &ref : refs) {
+                if (ref.bounds.max_point[split.axis] <= split.position) {
+                    left.push_back(ref);
+                } else if (ref.bounds.min_point[split.axis] >= split.position) {
+                    right.push_back(ref);
+                } else {
+                    // Straddles the plane: one clipped reference per side
+                    BVHPrimitive left_part = ref, right_part = ref;
+                    std::tie(left_part.bounds, right_part.bounds) =
+                        split_reference(ref, split.axis, split.position, state);
+                    left_part.centroid = left_part.bounds.get_center();
+                    right_part.centroid = right_part.bounds.get_center();
+                    left.push_back(left_part);
+                    right.push_back(right_part);
+                }
+            }
+            const uint32_t duplicates =
+                static_cast<uint32_t>(left.size() + right.size()) - count;
+            if (left.empty() || right.empty() ||
+                duplicates > state.remaining_duplicates) {
+                // The plane fell on the edge of every reference after all
+                left.clear();
+                right.clear();
+                spatial = false;
+                split = find_object_split(refs);
+            } else {
+                state.remaining_duplicates -= duplicates;
+            }
+        }
+        if (!spatial) {
+            if (split.valid() && depth < max_sah_depth) {
+                BoundingBox3f centroid_bounds = BoundingBox3f::empty();
+                for (const BVHPrimitive &ref : refs)
+                    centroid_bounds.include(ref.centroid);
+                const float axis_min = centroid_bounds.min_point[split.axis];
+                const float scale =
+                    num_bins /
+                    (centroid_bounds.max_point[split.axis] - axis_min);
+                for (const BVHPrimitive &ref : refs) {
+                    const int b = std::min(
+                        static_cast<int>(
+                            (ref.centroid[split.axis] - axis_min) * scale),
+                        num_bins - 1);
+                    (b < split.plane ? left : right).push_back(ref);
+                }
+            } else {
+                // No usable plane, or too deep: split at the object median
+                BoundingBox3f centroid_bounds = BoundingBox3f::empty();
+                for (const BVHPrimitive &ref : refs)
+                    centroid_bounds.include(ref.centroid);
+                const int axis = centroid_bounds.max_extent_axis();
+                const auto mid = refs.begin() + count / 2;
+                std::nth_element(refs.begin(), mid, refs.end(),
+                                 [axis](const BVHPrimitive &a,
+                                        const BVHPrimitive &b) {
+                                     return a.centroid[axis] < b.centroid[axis];
+                                 });
+                left.assign(refs.begin(), mid);
+                right.assign(mid, refs.end());
+                split.axis = axis;
+            }
+        }
+        refs.clear();
+        refs.shrink_to_fit();
+
+        BoundingBox3f left_bounds = BoundingBox3f::empty();
+        BoundingBox3f right_bounds = BoundingBox3f::empty();
+        for (const BVHPrimitive &ref : left) left_bounds.include(ref.bounds);
+        for (const BVHPrimitive &ref : right) right_bounds.include(ref.bounds);
+
+        const uint32_t node_idx = static_cast<uint32_t>(nodes.size());
+        nodes.push_back(
+            BVHNode{bounds, 0, 0, static_cast<uint8_t>(split.axis), 0});
+        num_interior_node++;
+        build_spatial(std::move(left), left_bounds, depth + 1, state);
+        const uint32_t second_child =
+            build_spatial(std::move(right), right_bounds, depth + 1, state);
+        nodes[node_idx].offset = second_child;
+        return node_idx;
+    }
+
+    /** Build the two children of an interior node, [begin, mid) and
+        [mid, end), with build_child(bvh, begin, end). Near the top of the tree
+        the second child is built into its own BVH on another thread and then
+        appended; the two children own disjoint primitive ranges.
+    */
+    template<typename BuildChild>
+    void build_children(uint32_t node_idx, uint32_t begin, uint32_t mid,
+                        uint32_t end, int depth, BuildChild build_child) {
+        // A couple of levels past parallel_depth there are a few tasks per
+        // core, which evens out unbalanced splits
+        if (parallel_depth > 0 && depth < parallel_depth + 2 &&
+            end - begin >= min_task_primitives) {
+            BVH second;
+            second.parallel_depth = parallel_depth;
+            auto task = std::async(std::launch::async,
+                                   [&] { build_child(second, mid, end); });
+            build_child(*this, begin, mid);
+            task.get();
+            nodes[node_idx].offset = append_subtree(second);
+        } else {
+            build_child(*this, begin, mid);
+            nodes[node_idx].offset = build_child(*this, mid, end);
+        }
+    }
+
+    /** Append a subtree built into another BVH, rebasing its interior nodes.
+        \return The index of the subtree's root.
+    */
+    uint32_t append_subtree(const BVH &subtree) {
+        const uint32_t base = static_cast<uint32_t>(nodes.size());
+        for (BVHNode node : subtree.nodes) {
+            if (!node.is_leaf()) node.offset += base;
+            nodes.push_back(node);
+        }
+        num_leaf_node += subtree.num_leaf_node;
+        num_interior_node += subtree.num_interior_node;
+        num_total_leaf_triangles += subtree.num_total_leaf_triangles;
+        return base;
+    }
+
+    uint32_t make_leaf(const BoundingBox3f &bounds, uint32_t begin,
+                       uint32_t end) {
+        const uint32_t node_idx = static_cast<uint32_t>(nodes.size());
+        nodes.push_back(BVHNode{bounds, begin,
+                                static_cast<uint16_t>(end - begin), 0, 0});
+        num_leaf_node++;
+        num_total_leaf_triangles += end - begin;
+        return node_idx;
+    }
+
+    uint32_t build(std::vector<BVHPrimitive> &primitives, uint32_t begin,
+                   uint32_t end, int depth) {
+        const uint32_t count = end - begin;
+        // Only the top levels, where there are fewer subtrees than cores, bin
+        // on all cores
+        const bool parallel_binning =
+            depth < parallel_depth && count >= 2 * min_parallel_primitives;
+
+        const auto [bounds, centroid_bounds] = fold_range<RangeBounds>(
+            begin, end, parallel_binning,
+            [&](RangeBounds &partial, uint32_t i) {
+                partial.bounds.include(primitives[i].bounds);
+                partial.centroid_bounds.include(primitives[i].centroid);
+            },
+            [](RangeBounds &partial, const RangeBounds &other) {
+                partial.bounds.include(other.bounds);
+                partial.centroid_bounds.include(other.centroid_bounds);
+            });
+
+        if (count == 1) return make_leaf(bounds, begin, end);
+
+        const int axis = centroid_bounds.max_extent_axis();
+        const float axis_min = centroid_bounds.min_point[axis];
+        const float axis_extent = centroid_bounds.max_point[axis] - axis_min;
+
+        uint32_t mid = begin + count / 2;
+        if (axis_extent <= 0.f) {
+            // All centroids coincide, no plane can separate them
+            if (count <= max_leaf_triangles)
+                return make_leaf(bounds, begin, end);
+        } else if (depth >= max_sah_depth) {
+            std::nth_element(primitives.begin() + begin,
+                             primitives.begin() + mid, primitives.begin() + end,
+                             [axis](const BVHPrimitive &a,
+                                    const BVHPrimitive &b) {
+                                 return a.centroid[axis] < b.centroid[axis];
+                             });
+        } else {
+            // Bin the centroids along the widest axis
+            const float scale = num_bins / axis_extent;
+            auto bin_of = [&](const BVHPrimitive &prim) {
+                int b = static_cast<int>((prim.centroid[axis] - axis_min) *
+                                         scale);
+                return std::min(b, num_bins - 1);
+            };
+            const Bins bins = fold_range<Bins>(
+                begin, end, parallel_binning,
+                [&](Bins &partial, uint32_t i) {
+                    const int b = bin_of(primitives[i]);
+                    partial.counts[b]++;
+                    partial.bounds[b].include(primitives[i].bounds);
+                },
+                [](Bins &partial, const Bins &other) {
+                    for (int b = 0; b < num_bins; b++) {
+                        partial.counts[b] += other.counts[b];
+                        partial.bounds[b].include(other.bounds[b]);
+                    }
+                });
+
+            // Sweep from the right to get the cost of every right side, then
+            // from the left to evaluate each of the num_bins - 1 planes
+            std::array<float, num_bins> right_area;
+            std::array<uint32_t, num_bins> right_count;
+            BoundingBox3f right_box = BoundingBox3f::empty();
+            uint32_t right_sum = 0;
+            for (int b = num_bins - 1; b > 0; b--) {
+                right_box.include(bins.bounds[b]);
+                right_sum += bins.counts[b];
+                right_area[b] = right_box.surface_area();
+                right_count[b] = right_sum;
+            }
+            BoundingBox3f left_box = BoundingBox3f::empty();
+            uint32_t left_sum = 0;
+            float best_cost = std::numeric_limits<float>::infinity();
+            int best_plane = -1;
+            for (int b = 1; b < num_bins; b++) {
+                left_box.include(bins.bounds[b - 1]);
+                left_sum += bins.counts[b - 1];
+                if (left_sum == 0 || right_count[b] == 0) continue;
+                const float cost =
+                    left_box.surface_area() * left_sum +
+                    right_area[b] * right_count[b];
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_plane = b;
+                }
+            }
+
+            const float inv_area = 1.f / bounds.surface_area();
+            const float split_cost =
+                traversal_cost + intersection_cost * best_cost * inv_area;
+            const float leaf_cost = intersection_cost * count;
+            if (count <= max_leaf_triangles &&
+                (best_plane < 0 || split_cost >= leaf_cost))
+                return make_leaf(bounds, begin, end);
+
+            if (best_plane >= 0) {
+                auto it = std::partition(
+                    primitives.begin() + begin, primitives.begin() + end,
+                    [&](const BVHPrimitive &prim) {
+                        return bin_of(prim) < best_plane;
+                    });
+                mid = static_cast<uint32_t>(it - primitives.begin());
+            }
+        }
+
+        const uint32_t node_idx = static_cast<uint32_t>(nodes.size());
+        nodes.push_back(BVHNode{bounds, 0, 0, static_cast<uint8_t>(axis), 0});
+        num_interior_node++;
+        build_children(node_idx, begin, mid, end, depth,
+                       [&](BVH &bvh, uint32_t child_begin, uint32_t child_end) {
+                           return bvh.build(primitives, child_begin, child_end,
+                                            depth + 1);
+                       });
+        return node_idx;
+    }
+
+    uint32_t build_linear(const std::vector<BVHPrimitive> &primitives,
+                          const std::vector<uint64_t> &codes, uint32_t begin,
+                          uint32_t end, int depth) {
+        const uint32_t count = end - begin;
+        if (count <= lbvh_leaf_triangles) {
+            BoundingBox3f bounds = BoundingBox3f::empty();
+            for (uint32_t i = begin; i < end; i++)
+                bounds.include(primitives[i].bounds);
+            return make_leaf(bounds, begin, end);
+        }
+
+        // Split where the highest differing bit of the range flips. Past
+        // max_sah_depth, or if all codes are equal, split at the median.
+        uint32_t mid = begin + count / 2;
+        int axis = 0;
+        const uint64_t differing = codes[begin] ^ codes[end - 1];
+        if (differing != 0) {
+            const int split_bit = 63 - std::countl_zero(differing);
+            axis = morton_bit_axis(split_bit);
+            if (depth < max_sah_depth) {
+                mid = static_cast<uint32_t>(
+                    std::partition_point(codes.begin() + begin,
+                                         codes.begin() + end,
+                                         [split_bit](uint64_t code) {
+                                             return !(code >> split_bit & 1);
+                                         }) -
+                    codes.begin());
+            }
+        }
+
+        const uint32_t node_idx = static_cast<uint32_t>(nodes.size());
+        nodes.push_back(BVHNode{BoundingBox3f::empty(), 0, 0,
+                                static_cast<uint8_t>(axis), 0});
+        num_interior_node++;
+        build_children(node_idx, begin, mid, end, depth,
+                       [&](BVH &bvh, uint32_t child_begin, uint32_t child_end) {
+                           return bvh.build_linear(primitives, codes,
+                                                   child_begin, child_end,
+                                                   depth + 1);
+                       });
+        nodes[node_idx].bounds.include(nodes[node_idx + 1].bounds);
+        nodes[node_idx].bounds.include(nodes[nodes[node_idx].offset].bounds);
+        return node_idx;
+    }
+
+    // Depth above which the build runs in parallel, set by build_bvh
+    int parallel_depth = 0;
+};
+
+}}  // namespace muni::RayTracer
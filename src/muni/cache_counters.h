@@ -0,0 +1,88 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace muni {
+
+/** Hardware counters of the L1 data cache and last level cache read misses of
+    the calling thread, read through perf_event_open on Linux. Elsewhere, or
+    when the kernel or the machine does not expose them, available() is false
+    and the counts stay zero.
+*/
+struct CacheMissCounters {
+    CacheMissCounters() {
+#ifdef __linux__
+        l1d_fd = open_counter(PERF_COUNT_HW_CACHE_L1D);
+        llc_fd = open_counter(PERF_COUNT_HW_CACHE_LL);
+#endif
+    }
+    ~CacheMissCounters() {
+#ifdef __linux__
+        if (l1d_fd >= 0) close(l1d_fd);
+        if (llc_fd >= 0) close(llc_fd);
+#endif
+    }
+    CacheMissCounters(const CacheMissCounters &) = delete;
+    CacheMissCounters &operator=(const CacheMissCounters &) = delete;
+
+    bool available() const { return l1d_fd >= 0 && llc_fd >= 0; }
+
+    /** Reset both counters and start counting. */
+    void start() {
+        l1d_misses = llc_misses = 0;
+#ifdef __linux__
+        for (int fd : {l1d_fd, llc_fd}) {
+            if (fd < 0) continue;
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    /** Stop counting and store the counts since start. */
+    void stop() {
+#ifdef __linux__
+        l1d_misses = read_counter(l1d_fd);
+        llc_misses = read_counter(llc_fd);
+#endif
+    }
+
+    uint64_t l1d_misses = 0;
+    uint64_t llc_misses = 0;
+
+private:
+#ifdef __linux__
+    static int open_counter(uint64_t cache) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = cache | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                      PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        return static_cast<int>(
+            syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+    static uint64_t read_counter(int fd) {
+        if (fd < 0) return 0;
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        uint64_t count = 0;
+        if (read(fd, &count, sizeof(count)) != sizeof(count)) return 0;
+        return count;
+    }
+#endif
+
+    int l1d_fd = -1;
+    int llc_fd = -1;
+};
+
+}  // namespace muni
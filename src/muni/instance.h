@@ -0,0 +1,312 @@
+#pragma once
+#include "common.h"
+#include "bounding_box.h"
+#include "bvh.h"
+#include "mesh.h"
+#include "ray.h"
+#include "ray_tracer.h"
+#include "triangle.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <numeric>
+#include <vector>
+
+namespace muni { namespace RayTracer {
+
+/** A mesh with its own acceleration structure, built once in object space and
+    shared by every instance that places it in the scene.
+*/
+struct BottomLevel {
+    /** Build the acceleration structure over the mesh.
+        \param[in] name The accelerator to build, see build_accelerator.
+        \param[in] mesh_triangles The triangles of the mesh, in object space.
+        \param[in] quantize Store child bounds in 8 bits.
+        \return The mesh, or nullptr if the accelerator name is unknown or
+        its build fails, which is logged.
+    */
+    static std::shared_ptr<const BottomLevel>
+    build(const std::string &name, TriangleMesh mesh_triangles,
+          bool quantize = false) {
+        auto mesh = std::make_shared<BottomLevel>();
+        mesh->triangles = std::move(mesh_triangles);
+        if (!build_accelerator(name, mesh->triangles, mesh->accelerator,
+                               quantize))
+            return nullptr;
+        for (size_t i = 0; i < mesh->triangles.size(); i++)
+            mesh->bounds.include(
+                BoundingBox3f::from_triangle(mesh->triangles[i]));
+        return mesh;
+    }
+
+    TriangleMesh triangles;
+    Accelerator accelerator;
+    BoundingBox3f bounds = BoundingBox3f::empty();
+};
+
+/** A placement of a shared mesh in the scene by an affine transform,
+    world = linear * object + translation.
+*/
+struct Instance {
+    /** Place a mesh in the scene.
+        \param[in] mesh The mesh to place.
+        \param[in] linear The rotation, scale and shear of the instance. Must
+        be invertible.
+        \param[in] translation The translation of the instance.
+    */
+    Instance(std::shared_ptr<const BottomLevel> mesh, const Mat3f &linear,
+             Vec3f translation)
+        : mesh(std::move(mesh)) {
+        set_transform(linear, translation);
+    }
+
+    /** Move the instance. Only the top level has to be rebuilt afterwards,
+        the mesh and its acceleration structure stay as they are.
+    */
+    void set_transform(const Mat3f &new_linear, Vec3f new_translation) {
+        linear = new_linear;
+        translation = new_translation;
+        inv_linear = inverse(linear);
+        inv_translation = -mul(inv_linear, translation);
+        normal_matrix = transpose(inv_linear);
+
+        world_bounds = BoundingBox3f::empty();
+        for (int i = 0; i < 8; i++)
+            world_bounds.include(to_world(mesh->bounds.get_corner(i)));
+    }
+
+    Vec3f to_world(Vec3f p) const { return mul(linear, p) + translation; }
+
+    /** The ray in object space. The direction is transformed but not
+        normalized, so t values are the same in both spaces and hits from
+        different instances can be compared directly.
+    */
+    Ray to_object(const Ray &ray) const {
+        return Ray(mul(inv_linear, ray.origin) + inv_translation,
+                   mul(inv_linear, ray.direction));
+    }
+
+    /** A mesh triangle moved into world space, for shading. */
+    Triangle to_world(const Triangle &tri) const {
+        Triangle result = tri;
+        result.v0 = to_world(tri.v0);
+        result.v1 = to_world(tri.v1);
+        result.v2 = to_world(tri.v2);
+        result.face_normal = normalize(mul(normal_matrix, tri.face_normal));
+        return result;
+    }
+
+    std::shared_ptr<const BottomLevel> mesh;
+    Mat3f linear;
+    Vec3f translation;
+    Mat3f inv_linear;
+    Vec3f inv_translation;
+    // Inverse transpose of linear, which keeps normals perpendicular to the
+    // transformed surface under non-uniform scale
+    Mat3f normal_matrix;
+    BoundingBox3f world_bounds;
+};
+
+/** The top level of a two-level scene: a BVH over the world bounds of the
+    instances, whose leaves hand the ray, moved into object space, to the
+    acceleration structure of the instanced mesh. Memory grows with the
+    number of distinct meshes plus a small record per instance, and moving an
+    instance only needs build() again, which is cheap next to rebuilding the
+    meshes.
+*/
+struct TopLevel {
+    /** Build the BVH over the current instances, splitting at the median
+        centroid along the widest axis. Instances are few compared to
+        triangles, so the SAH would not pay for itself here.
+    */
+    void build() {
+        const auto start = std::chrono::steady_clock::now();
+        nodes.clear();
+        instance_order.resize(instances.size());
+        std::iota(instance_order.begin(), instance_order.end(), 0u);
+        if (instances.empty()) return;
+
+        nodes.reserve(2 * instances.size());
+        build_node(0, static_cast<uint32_t>(instances.size()), 0);
+
+        const std::chrono::duration<double, std::milli> elapsed =
+            std::chrono::steady_clock::now() - start;
+        spdlog::info("Top level: {} instances, {} nodes, built in {:.3f} ms",
+                     instances.size(), nodes.size(), elapsed.count());
+    }
+
+    /** Find the closest hit over all instances, see BVH::bvh_traversal. The
+        hit's triangle index refers to the triangles of the instance's mesh.
+        \param[in] ray The ray in world space.
+        \param[in] t_max The maximum t value to consider.
+        \return The closest hit, if any, with instance_idx set.
+    */
+    HitRecord closest_hit(const Ray &ray, float t_max) const {
+        HitRecord rec;
+        rec.t = t_max;
+        if (nodes.empty()) return rec;
+
+        uint32_t stack[max_stack_depth];
+        int stack_size = 0;
+        uint32_t node_idx = 0;
+        while (true) {
+            const BVHNode &node = nodes[node_idx];
+            auto [hit, t_near, t_far] = node.bounds.ray_intersect(ray);
+            if (hit && t_near <= rec.t) {
+                if (node.is_leaf()) {
+                    for (uint32_t i = node.offset;
+                         i < node.offset + node.num_triangles; i++) {
+                        const uint32_t instance_idx = instance_order[i];
+                        const Instance &instance = instances[instance_idx];
+                        const HitRecord instance_rec = RayTracer::closest_hit(
+                            instance.to_object(ray), rec.t,
+                            instance.mesh->accelerator,
+                            instance.mesh->triangles);
+                        if (instance_rec.is_hit()) {
+                            rec = instance_rec;
+                            rec.instance_idx = instance_idx;
+                        }
+                    }
+                } else {
+                    if (ray.dir_is_neg[node.split_axis]) {
+                        stack[stack_size++] = node_idx + 1;
+                        node_idx = node.offset;
+                    } else {
+                        stack[stack_size++] = node.offset;
+                        node_idx = node_idx + 1;
+                    }
+                    continue;
+                }
+            }
+            if (stack_size == 0) break;
+            node_idx = stack[--stack_size];
+        }
+        return rec;
+    }
+
+    /** Check whether any instance blocks the ray before t_max - ANYHIT_EPS.
+        \param[in] ray The ray in world space.
+        \param[in] t_max The distance to the target point.
+        \return True if the ray is blocked, false otherwise.
+    */
+    bool occluded(const Ray &ray, float t_max) const {
+        if (nodes.empty()) return false;
+
+        uint32_t stack[max_stack_depth];
+        int stack_size = 0;
+        uint32_t node_idx = 0;
+        while (true) {
+            const BVHNode &node = nodes[node_idx];
+            auto [hit, t_near, t_far] = node.bounds.ray_intersect(ray);
+            if (hit && t_near <= t_max - ANYHIT_EPS) {
+                if (node.is_leaf()) {
+                    for (uint32_t i = node.offset;
+                         i < node.offset + node.num_triangles; i++) {
+                        const Instance &instance = instances[instance_order[i]];
+                        if (RayTracer::occluded(instance.to_object(ray), t_max,
+                                                instance.mesh->accelerator,
+                                                instance.mesh->triangles))
+                            return true;
+                    }
+                } else {
+                    stack[stack_size++] = node.offset;
+                    node_idx = node_idx + 1;
+                    continue;
+                }
+            }
+            if (stack_size == 0) return false;
+            node_idx = stack[--stack_size];
+        }
+    }
+
+    /** The hit triangle in world space. */
+    Triangle hit_triangle(const HitRecord &rec) const {
+        const Instance &instance = instances[rec.instance_idx];
+        return instance.to_world(
+            instance.mesh->triangles.triangle(rec.triangle_idx));
+    }
+
+    /** Bytes taken by the top level and the distinct meshes it references,
+        excluding the meshes' acceleration structures.
+    */
+    size_t memory_usage() const {
+        size_t bytes = nodes.size() * sizeof(BVHNode) +
+                       instances.size() * sizeof(Instance) +
+                       instance_order.size() * sizeof(uint32_t);
+        std::vector<const BottomLevel *> meshes;
+        for (const Instance &instance : instances)
+            meshes.push_back(instance.mesh.get());
+        std::sort(meshes.begin(), meshes.end());
+        meshes.erase(std::unique(meshes.begin(), meshes.end()), meshes.end());
+        for (const BottomLevel *mesh : meshes)
+            bytes += mesh->triangles.memory_usage();
+        return bytes;
+    }
+
+    std::vector<Instance> instances;
+
+private:
+    static constexpr int max_stack_depth = 64;
+    static constexpr uint32_t max_leaf_size = 2;
+
+    // Nodes are BVHNodes, but leaf offsets and counts index instance_order
+    // rather than triangles
+    void build_node(uint32_t begin, uint32_t end, int depth) {
+        const uint32_t node_idx = static_cast<uint32_t>(nodes.size());
+        nodes.emplace_back();
+
+        BoundingBox3f bounds = BoundingBox3f::empty();
+        BoundingBox3f centroid_bounds = BoundingBox3f::empty();
+        for (uint32_t i = begin; i < end; i++) {
+            const BoundingBox3f &box = instances[instance_order[i]].world_bounds;
+            bounds.include(box);
+            centroid_bounds.include(box.get_center());
+        }
+        nodes[node_idx].bounds = bounds;
+
+        if (end - begin <= max_leaf_size || depth + 1 >= max_stack_depth) {
+            nodes[node_idx].offset = begin;
+            nodes[node_idx].num_triangles = static_cast<uint16_t>(end - begin);
+            return;
+        }
+
+        const int axis = centroid_bounds.max_extent_axis();
+        const uint32_t mid = begin + (end - begin) / 2;
+        std::nth_element(
+            instance_order.begin() + begin, instance_order.begin() + mid,
+            instance_order.begin() + end, [&](uint32_t a, uint32_t b) {
+                return instances[a].world_bounds.get_center()[axis] <
+                       instances[b].world_bounds.get_center()[axis];
+            });
+        nodes[node_idx].split_axis = static_cast<uint8_t>(axis);
+        nodes[node_idx].num_triangles = 0;
+        build_node(begin, mid, depth + 1);
+        nodes[node_idx].offset = static_cast<uint32_t>(nodes.size());
+        build_node(mid, end, depth + 1);
+    }
+
+    std::vector<BVHNode> nodes;
+    // Instance indices in leaf order, so instance indices stay stable
+    // across rebuilds
+    std::vector<uint32_t> instance_order;
+};
+
+/** Find the closest hit in a two-level scene, see closest_hit above. */
+static HitRecord closest_hit(Vec3f ray_pos, Vec3f ray_dir,
+                             const TopLevel &scene) {
+    return scene.closest_hit(Ray(ray_pos, ray_dir),
+                             std::numeric_limits<float>::infinity());
+}
+
+/** Check whether two points of a two-level scene can see each other, see
+    visible above.
+*/
+static bool visible(Vec3f from, Vec3f to, const TopLevel &scene) {
+    const Vec3f dir = to - from;
+    const float dist = length(dir);
+    if (dist <= EPS) return true;
+    return !scene.occluded(Ray(from, dir / dist), dist);
+}
+
+}}  // namespace muni::RayTracer
@@ -0,0 +1,65 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+
+namespace muni {
+
+/** Remembers which triangles a ray has already been tested against, so a
+    triangle referenced by several leaves is only intersected once per ray.
+    A small direct-mapped cache keyed on the low bits of the triangle index
+    lives on the traversal's stack, so no ray IDs or per-thread arrays are
+    needed. Two triangles mapping to the same slot evict each other, which only
+    costs a redundant test, never a missed one.
+*/
+struct Mailbox {
+    static constexpr uint32_t size = 64;
+    static constexpr uint32_t empty_slot = UINT32_MAX;
+
+    Mailbox() { std::fill(slots, slots + size, empty_slot); }
+
+    /** Whether the triangle has been tested on this ray. */
+    bool contains(uint32_t tri_idx) const {
+        return slots[tri_idx % size] == tri_idx;
+    }
+
+    /** Record that the triangle has been tested on this ray. */
+    void insert(uint32_t tri_idx) { slots[tri_idx % size] = tri_idx; }
+
+    uint32_t slots[size];
+    // Triangle tests done and skipped on this ray
+    uint32_t num_tests = 0;
+    uint32_t num_skipped = 0;
+};
+
+/** Totals of the Mailbox counters over all rays, safe to update from the
+    rendering threads. Every ray adds its counts once, when it finishes, so
+    the rendering threads contend on them; only count when the totals are
+    wanted.
+*/
+struct MailboxCounters {
+    MailboxCounters() = default;
+    MailboxCounters(const MailboxCounters &other) { *this = other; }
+    MailboxCounters &operator=(const MailboxCounters &other) {
+        num_tests.store(other.num_tests.load(std::memory_order_relaxed),
+                        std::memory_order_relaxed);
+        num_skipped.store(other.num_skipped.load(std::memory_order_relaxed),
+                          std::memory_order_relaxed);
+        return *this;
+    }
+
+    void add(const Mailbox &mailbox) {
+        num_tests.fetch_add(mailbox.num_tests, std::memory_order_relaxed);
+        num_skipped.fetch_add(mailbox.num_skipped, std::memory_order_relaxed);
+    }
+
+    void reset() {
+        num_tests.store(0, std::memory_order_relaxed);
+        num_skipped.store(0, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> num_tests{0};
+    std::atomic<uint64_t> num_skipped{0};
+};
+
+}  // namespace muni
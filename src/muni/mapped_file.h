@@ -0,0 +1,169 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <system_error>
+#include <utility>
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <fstream>
+#include <iterator>
+#include <vector>
+#endif
+
+namespace muni {
+
+/** A whole file mapped read-only into memory, so it can be read in place
+    without copying it through a stream first. Pages are only read from disk
+    when touched, and files already in the page cache cost no I/O at all.
+    Where mmap is unavailable the file is read into memory instead.
+*/
+struct MappedFile {
+    MappedFile() = default;
+    ~MappedFile() { close(); }
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    MappedFile(MappedFile &&other) noexcept { *this = std::move(other); }
+    MappedFile &operator=(MappedFile &&other) noexcept {
+        if (this == &other) return *this;
+        close();
+        bytes = other.bytes;
+        num_bytes = other.num_bytes;
+        other.bytes = nullptr;
+        other.num_bytes = 0;
+#ifndef __linux__
+        buffer = std::move(other.buffer);
+#endif
+        return *this;
+    }
+
+    /** Map a file, replacing any file mapped before.
+        \param[in] path The file to map.
+        \return False if the file cannot be opened or mapped.
+    */
+    bool open(const std::string &path) {
+        close();
+#ifdef __linux__
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return false;
+        }
+        num_bytes = static_cast<size_t>(st.st_size);
+        if (num_bytes > 0) {
+            void *mapping =
+                mmap(nullptr, num_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) {
+                ::close(fd);
+                num_bytes = 0;
+                return false;
+            }
+            bytes = static_cast<const uint8_t *>(mapping);
+        }
+        // The mapping keeps the file alive on its own
+        ::close(fd);
+        return true;
+#else
+        std::ifstream file(path, std::ios::binary);
+        if (!file) return false;
+        buffer.assign(std::istreambuf_iterator<char>(file),
+                      std::istreambuf_iterator<char>());
+        bytes = reinterpret_cast<const uint8_t *>(buffer.data());
+        num_bytes = buffer.size();
+        return true;
+#endif
+    }
+
+    void close() {
+#ifdef __linux__
+        if (bytes) munmap(const_cast<uint8_t *>(bytes), num_bytes);
+#else
+        buffer.clear();
+#endif
+        bytes = nullptr;
+        num_bytes = 0;
+    }
+
+    const uint8_t *data() const { return bytes; }
+    size_t size() const { return num_bytes; }
+
+private:
+    const uint8_t *bytes = nullptr;
+    size_t num_bytes = 0;
+#ifndef __linux__
+    std::vector<char> buffer;
+#endif
+};
+
+/** Write a file under a temporary name next to path and rename it into
+    place, so readers mapping path never see a half-written file, even with
+    several jobs writing it at once.
+    \param[in] path The file to write.
+    \param[in] data The bytes to write.
+    \param[in] size The number of bytes.
+    \return False if the file could not be written.
+*/
+inline bool write_file_atomically(const std::string &path, const void *data,
+                                  size_t size) {
+    // Unique per writer, so concurrent writers do not write into each
+    // other's file
+    const std::string tmp_path =
+        path + "." +
+        std::to_string(
+            std::chrono::steady_clock::now().time_since_epoch().count()) +
+        ".tmp";
+    std::FILE *file = std::fopen(tmp_path.c_str(), "wb");
+    if (!file) return false;
+    const bool written = std::fwrite(data, 1, size, file) == size;
+    if (std::fclose(file) != 0 || !written ||
+        std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+/** The size and modification time of a file. Cheap to read, unlike the
+    contents, so caches derived from a file record these to notice when it
+    changes. A rewrite of the same size within the file system's timestamp
+    resolution goes unnoticed.
+    \param[in] path The file.
+    \param[out] size The size in bytes.
+    \param[out] time The modification time, in ticks of the file clock.
+    \return False if the file cannot be stat'ed.
+*/
+inline bool file_stamp(const std::string &path, uint64_t &size,
+                       int64_t &time) {
+    std::error_code error;
+    size = std::filesystem::file_size(path, error);
+    if (error) return false;
+    time = std::filesystem::last_write_time(path, error)
+               .time_since_epoch()
+               .count();
+    return !error;
+}
+
+/** 64-bit FNV-1a hash of a byte range, chained through seed so several
+    ranges can be hashed as one.
+*/
+inline uint64_t hash_bytes(const void *data, size_t size,
+                           uint64_t seed = 0xcbf29ce484222325ull) {
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    uint64_t hash = seed;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+}  // namespace muni
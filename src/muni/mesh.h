@@ -0,0 +1,109 @@
+#pragma once
+#include "common.h"
+#include "parallel.h"
+#include "triangle.h"
+#include <cstdint>
+#include <vector>
+
+namespace muni {
+
+/** Triangles stored as an indexed mesh: one buffer of vertex positions that
+    neighbouring faces share, three indices into it per face and the material
+    of every face. A face takes 16 bytes plus its share of the vertices, about
+    a third of a Triangle, which repeats its vertices and also carries a
+    normal and an emission. The acceleration structures read faces through
+    operator[], and a full Triangle is only assembled for shading.
+*/
+struct TriangleMesh {
+    size_t size() const { return material_ids.size(); }
+    bool empty() const { return material_ids.empty(); }
+
+    /** The corners of a face. */
+    TriangleVertices operator[](size_t face) const {
+        const uint32_t *corners = &indices[3 * face];
+        return {vertices[corners[0]], vertices[corners[1]],
+                vertices[corners[2]]};
+    }
+
+    /** A face as a Triangle, for shading. Its normal follows the winding of
+        the face, and it does not emit.
+    */
+    Triangle triangle(size_t face) const {
+        const TriangleVertices tri = (*this)[face];
+        return Triangle{tri.v0,
+                        tri.v1,
+                        tri.v2,
+                        normalize(cross(tri.v1 - tri.v0, tri.v2 - tri.v0)),
+                        Vec3f{0.0f},
+                        material_ids[face]};
+    }
+
+    /** Append triangles as faces with vertices of their own. Only their
+        vertices and materials are kept.
+    */
+    void append(const std::vector<Triangle> &triangles) {
+        vertices.reserve(vertices.size() + 3 * triangles.size());
+        indices.reserve(indices.size() + 3 * triangles.size());
+        material_ids.reserve(material_ids.size() + triangles.size());
+        for (const Triangle &tri : triangles) {
+            for (const Vec3f &v : {tri.v0, tri.v1, tri.v2}) {
+                indices.push_back(static_cast<uint32_t>(vertices.size()));
+                vertices.push_back(v);
+            }
+            material_ids.push_back(tri.material_id);
+        }
+    }
+
+    /** Append the faces of another mesh after the faces of this one. */
+    void append(const TriangleMesh &mesh) {
+        const uint32_t first_vertex = static_cast<uint32_t>(vertices.size());
+        vertices.insert(vertices.end(), mesh.vertices.begin(),
+                        mesh.vertices.end());
+        indices.reserve(indices.size() + mesh.indices.size());
+        for (uint32_t index : mesh.indices)
+            indices.push_back(first_vertex + index);
+        material_ids.insert(material_ids.end(), mesh.material_ids.begin(),
+                            mesh.material_ids.end());
+    }
+
+    /** Reorder the faces, so that face i becomes the face order[i] was. A
+        face may be listed several times or not at all. The vertices stay
+        where they are, so this only moves 16 bytes per face.
+        \param[in] order The old index of every new face.
+    */
+    void reorder(const std::vector<uint32_t> &order) {
+        const uint32_t num_faces = static_cast<uint32_t>(order.size());
+        std::vector<uint32_t> ordered_indices(3 * size_t(num_faces));
+        std::vector<uint32_t> ordered_material_ids(num_faces);
+        parallel_chunks(0, num_faces, min_parallel_faces,
+                        [&](unsigned int, uint32_t begin, uint32_t end) {
+                            for (uint32_t i = begin; i < end; i++) {
+                                const size_t face = order[i];
+                                for (int k = 0; k < 3; k++)
+                                    ordered_indices[3 * size_t(i) + k] =
+                                        indices[3 * face + k];
+                                ordered_material_ids[i] = material_ids[face];
+                            }
+                        });
+        indices.swap(ordered_indices);
+        material_ids.swap(ordered_material_ids);
+    }
+
+    /** Bytes taken by the vertices, indices and materials. */
+    size_t memory_usage() const {
+        return vertices.size() * sizeof(Vec3f) +
+               indices.size() * sizeof(uint32_t) +
+               material_ids.size() * sizeof(uint32_t);
+    }
+
+    std::vector<Vec3f> vertices;
+    // Three indices into vertices per face
+    std::vector<uint32_t> indices;
+    std::vector<uint32_t> material_ids;
+
+private:
+    // Meshes smaller than this are reordered on one thread
+    static constexpr uint32_t min_parallel_faces = 1 << 14;
+};
+
+}  // namespace muni
@@ -0,0 +1,224 @@
+#pragma once
+#include "common.h"
+#include "mapped_file.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace muni {
+
+/** A triangle mesh in a compact binary format: a header, the vertex
+    positions, three vertex indices per face and a material per face, each
+    buffer aligned to a cache line, followed by the usemtl names the
+    materials number. Opening maps the file and the accessors point into
+    the mapping, so nothing is parsed. load_obj still copies each buffer
+    once out of the mapping into the TriangleMesh, which must own its
+    buffers. The header records the size and modification time of the file
+    the mesh was converted from, and a mesh whose source has changed since
+    fails to open.
+*/
+struct MeshFile {
+    static constexpr char magic[8] = {'M', 'U', 'N', 'I', 'M', 'S', 'H', '\0'};
+    static constexpr uint32_t version = 2;
+    static constexpr size_t alignment = 64;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t source_size;
+        int64_t source_time;
+        uint64_t num_vertices;
+        uint64_t num_faces;
+        // Byte offsets of the buffers from the start of the file
+        uint64_t vertex_offset;
+        uint64_t index_offset;
+        uint64_t material_offset;
+        // The material names, each ended by a newline
+        uint64_t num_materials;
+        uint64_t name_offset;
+        uint64_t name_size;
+    };
+    static_assert(sizeof(Vec3f) == 3 * sizeof(float),
+                  "vertices are stored as packed float triples");
+
+    /** The mesh file kept next to a source file. */
+    static std::string path_for(const std::string &source_path) {
+        return source_path + ".mesh";
+    }
+
+    /** Write a mesh, converted from source_path, to a mesh file, see
+        write_file_atomically.
+        \param[in] path The mesh file.
+        \param[in] source_path The file the mesh was converted from.
+        \param[in] vertices The vertex positions.
+        \param[in] indices Three indices into vertices per face.
+        \param[in] face_materials The material of each face, an index into
+        material_names or -1.
+        \param[in] material_names The material names, see ObjParser.
+        \return False if the file could not be written.
+    */
+    static bool save(const std::string &path, const std::string &source_path,
+                     const std::vector<Vec3f> &vertices,
+                     const std::vector<uint32_t> &indices,
+                     const std::vector<int32_t> &face_materials,
+                     const std::vector<std::string> &material_names) {
+        Header header{};
+        std::memcpy(header.magic, magic, sizeof(magic));
+        header.version = version;
+        if (!file_stamp(source_path, header.source_size, header.source_time))
+            return false;
+        header.num_vertices = vertices.size();
+        header.num_faces = face_materials.size();
+        header.vertex_offset = align(sizeof(Header));
+        header.index_offset =
+            align(header.vertex_offset + vertices.size() * sizeof(Vec3f));
+        header.material_offset =
+            align(header.index_offset + indices.size() * sizeof(uint32_t));
+        std::string names;
+        for (const std::string &name : material_names) names += name + '\n';
+        header.num_materials = material_names.size();
+        header.name_offset =
+            header.material_offset + face_materials.size() * sizeof(int32_t);
+        header.name_size = names.size();
+        const size_t file_size = header.name_offset + names.size();
+
+        std::vector<uint8_t> bytes(file_size, 0);
+        std::memcpy(bytes.data(), &header, sizeof(header));
+        std::memcpy(bytes.data() + header.vertex_offset, vertices.data(),
+                    vertices.size() * sizeof(Vec3f));
+        std::memcpy(bytes.data() + header.index_offset, indices.data(),
+                    indices.size() * sizeof(uint32_t));
+        std::memcpy(bytes.data() + header.material_offset,
+                    face_materials.data(),
+                    face_materials.size() * sizeof(int32_t));
+        std::memcpy(bytes.data() + header.name_offset, names.data(),
+                    names.size());
+
+        if (!write_file_atomically(path, bytes.data(), bytes.size())) {
+            spdlog::warn("Cannot write the mesh file {}", path);
+            return false;
+        }
+        spdlog::info("Saved the mesh file {} ({:.1f} KiB)", path,
+                     bytes.size() / 1024.0);
+        return true;
+    }
+
+    /** Map a mesh file converted from source_path.
+        \param[in] path The mesh file.
+        \param[in] source_path The file the mesh must have been converted from.
+        \return False if the mesh file is missing, was written by another
+        version, is older than its source or is corrupt.
+    */
+    bool open(const std::string &path, const std::string &source_path) {
+        close();
+        if (!file.open(path)) return false;
+
+        uint64_t source_size = 0;
+        int64_t source_time = 0;
+        if (file.size() < sizeof(Header) ||
+            !file_stamp(source_path, source_size, source_time)) {
+            close();
+            return false;
+        }
+        header = reinterpret_cast<const Header *>(file.data());
+        if (std::memcmp(header->magic, magic, sizeof(magic)) ||
+            header->version != version ||
+            header->source_size != source_size ||
+            header->source_time != source_time) {
+            spdlog::info("Ignoring the stale mesh file {}", path);
+            close();
+            return false;
+        }
+        if (!valid()) {
+            spdlog::warn("Ignoring the corrupt mesh file {}", path);
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+        file.close();
+        header = nullptr;
+    }
+
+    size_t num_vertices() const { return header ? header->num_vertices : 0; }
+    size_t num_faces() const { return header ? header->num_faces : 0; }
+    const Vec3f *vertices() const {
+        return reinterpret_cast<const Vec3f *>(file.data() +
+                                               header->vertex_offset);
+    }
+    const uint32_t *indices() const {
+        return reinterpret_cast<const uint32_t *>(file.data() +
+                                                  header->index_offset);
+    }
+    const int32_t *face_materials() const {
+        return reinterpret_cast<const int32_t *>(file.data() +
+                                                 header->material_offset);
+    }
+    std::vector<std::string> material_names() const {
+        std::vector<std::string> names;
+        const char *p =
+            reinterpret_cast<const char *>(file.data() + header->name_offset);
+        const char *end = p + header->name_size;
+        while (p < end) {
+            const char *newline =
+                static_cast<const char *>(std::memchr(p, '\n', end - p));
+            names.emplace_back(p, newline);
+            p = newline + 1;
+        }
+        return names;
+    }
+
+private:
+    static size_t align(size_t offset) {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    // Buffers lie in order inside the file, every index names a vertex and
+    // every material a name. Checking them once here keeps traversal and
+    // material lookups free of bounds checks
+    bool valid() const {
+        const uint64_t faces = header->num_faces;
+        if (header->num_vertices > file.size() / sizeof(Vec3f) ||
+            faces > file.size() / (3 * sizeof(uint32_t)) ||
+            header->vertex_offset < sizeof(Header) ||
+            header->vertex_offset > file.size() ||
+            header->vertex_offset % alignof(Vec3f) != 0 ||
+            header->index_offset % alignof(uint32_t) != 0 ||
+            header->material_offset % alignof(int32_t) != 0 ||
+            header->index_offset < header->vertex_offset +
+                                       header->num_vertices * sizeof(Vec3f) ||
+            header->material_offset <
+                header->index_offset + 3 * faces * sizeof(uint32_t) ||
+            header->material_offset > file.size() ||
+            (file.size() - header->material_offset) / sizeof(int32_t) < faces ||
+            header->name_offset <
+                header->material_offset + faces * sizeof(int32_t) ||
+            header->name_offset > file.size() ||
+            header->name_size != file.size() - header->name_offset)
+            return false;
+        const uint32_t *face_indices = indices();
+        for (uint64_t i = 0; i < 3 * faces; i++)
+            if (face_indices[i] >= header->num_vertices) return false;
+        const int32_t *materials = face_materials();
+        for (uint64_t i = 0; i < faces; i++)
+            if (materials[i] < -1 ||
+                materials[i] >= static_cast<int64_t>(header->num_materials))
+                return false;
+        // Every name ends with a newline
+        const char *names =
+            reinterpret_cast<const char *>(file.data() + header->name_offset);
+        return std::count(names, names + header->name_size, '\n') ==
+                   static_cast<int64_t>(header->num_materials) &&
+               (header->name_size == 0 || names[header->name_size - 1] == '\n');
+    }
+
+    MappedFile file;
+    const Header *header = nullptr;
+};
+
+}  // namespace muni
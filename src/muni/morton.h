@@ -0,0 +1,89 @@
+#pragma once
+#include "parallel.h"
+#include <array>
+#include <cstdint>
+#include <vector>
+
+namespace muni {
+
+/** Spread the low 21 bits of x so that there are two zero bits between
+    every pair of them.
+*/
+inline uint64_t expand_bits_21(uint64_t x) {
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffffull;
+    x = (x | x << 16) & 0x1f0000ff0000ffull;
+    x = (x | x << 8) & 0x100f00f00f00f00full;
+    x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+    x = (x | x << 2) & 0x1249249249249249ull;
+    return x;
+}
+
+/** 63-bit Morton code of a point with 21-bit integer coordinates. Bit
+    3 * i + 2 holds bit i of x, 3 * i + 1 of y and 3 * i of z.
+*/
+inline uint64_t morton_encode_63(uint32_t x, uint32_t y, uint32_t z) {
+    return expand_bits_21(x) << 2 | expand_bits_21(y) << 1 | expand_bits_21(z);
+}
+
+/** The axis a bit of morton_encode_63 belongs to. */
+inline int morton_bit_axis(int bit) { return 2 - bit % 3; }
+
+/** Sort keys ascending and apply the same permutation to values, with a
+    stable LSD radix sort over 8-bit digits. Every pass histograms and then
+    scatters the same chunks of the input on separate threads; passes where all
+    keys share the digit are skipped.
+    \param[in,out] keys The keys to sort.
+    \param[in,out] values One value per key.
+*/
+inline void radix_sort(std::vector<uint64_t> &keys,
+                       std::vector<uint32_t> &values) {
+    constexpr int radix_bits = 8;
+    constexpr int radix = 1 << radix_bits;
+    constexpr uint32_t min_chunk_size = 1 << 14;
+
+    const uint32_t count = static_cast<uint32_t>(keys.size());
+    const unsigned int num_chunks = num_chunks_for(count, min_chunk_size);
+    std::vector<uint64_t> keys_tmp(count);
+    std::vector<uint32_t> values_tmp(count);
+    std::vector<std::array<uint32_t, radix>> offsets(num_chunks);
+
+    for (int shift = 0; shift < 64; shift += radix_bits) {
+        run_chunks(0, count, num_chunks,
+                   [&](unsigned int chunk, uint32_t begin, uint32_t end) {
+                       offsets[chunk].fill(0);
+                       for (uint32_t i = begin; i < end; i++)
+                           offsets[chunk][(keys[i] >> shift) & (radix - 1)]++;
+                   });
+
+        // Turn the counts into scatter offsets, digit by digit, and within a
+        // digit chunk by chunk so the sort stays stable
+        uint32_t sum = 0;
+        bool single_digit = false;
+        for (int digit = 0; digit < radix; digit++) {
+            uint32_t digit_count = 0;
+            for (unsigned int chunk = 0; chunk < num_chunks; chunk++) {
+                const uint32_t chunk_count = offsets[chunk][digit];
+                offsets[chunk][digit] = sum + digit_count;
+                digit_count += chunk_count;
+            }
+            if (digit_count == count) single_digit = true;
+            sum += digit_count;
+        }
+        if (single_digit) continue;
+
+        run_chunks(0, count, num_chunks,
+                   [&](unsigned int chunk, uint32_t begin, uint32_t end) {
+                       for (uint32_t i = begin; i < end; i++) {
+                           const uint32_t dst =
+                               offsets[chunk][(keys[i] >> shift) & (radix - 1)]++;
+                           keys_tmp[dst] = keys[i];
+                           values_tmp[dst] = values[i];
+                       }
+                   });
+        keys.swap(keys_tmp);
+        values.swap(values_tmp);
+    }
+}
+
+}  // namespace muni
@@ -1,73 +1,138 @@
 #include "spdlog/spdlog.h"
-#define TINYOBJLOADER_IMPLEMENTATION // define this in only *one* .cc
-// Optional. define TINYOBJLOADER_USE_MAPBOX_EARCUT gives robust trinagulation. Requires C++11
-// #define TINYOBJLOADER_USE_MAPBOX_EARCUT
-#include "tiny_obj_loader.h"
 #include "common.h"
+#include "mesh.h"
+#include "mesh_cache.h"
+#include "obj_parser.h"
 #include "triangle.h"
+#include <chrono>
+#include <cstdint>
 #include <iostream>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <vector>
 namespace muni
 {
-  Vec3f cal_face_normal(Vec3f v0, Vec3f v1, Vec3f v2)
+  /** Scene material ids by usemtl name, see load_obj. */
+  using MaterialMap = std::unordered_map<std::string, int>;
+
+  /** The scene material of every face: material_id, or the id
+      usemtl_materials gives the name of the face's usemtl material.
+      \param[in] face_materials The usemtl material of each face, an index
+      into material_names or -1, see ObjParser.
+      \param[in] num_materials The size of the scene's material table.
+      \param[out] material_ids The scene material of each face.
+      \return False if a material falls outside the scene's table, which is
+      logged.
+  */
+  bool assign_face_materials(const int32_t *face_materials, size_t num_faces,
+                             const std::vector<std::string> &material_names,
+                             int material_id,
+                             const MaterialMap &usemtl_materials,
+                             size_t num_materials,
+                             std::vector<uint32_t> &material_ids)
   {
-    Vec3f e1 = v1 - v0;
-    Vec3f e2 = v2 - v0;
-    return normalize(cross(e1, e2));
+    auto in_table = [&](int id)
+    { return id >= 0 && static_cast<size_t>(id) < num_materials; };
+    if (!in_table(material_id))
+    {
+      spdlog::error("Material {} is outside the scene's {} materials",
+                    material_id, num_materials);
+      return false;
+    }
+    std::vector<int> scene_ids(material_names.size(), material_id);
+    for (size_t m = 0; m < material_names.size(); m++)
+    {
+      const auto it = usemtl_materials.find(material_names[m]);
+      if (it != usemtl_materials.end())
+      {
+        scene_ids[m] = it->second;
+      }
+      else if (!usemtl_materials.empty())
+      {
+        spdlog::warn("No scene material for usemtl {}, using material {}",
+                     material_names[m], material_id);
+      }
+      if (!in_table(scene_ids[m]))
+      {
+        spdlog::error("usemtl {} maps to material {}, outside the scene's {} "
+                      "materials",
+                      material_names[m], scene_ids[m], num_materials);
+        return false;
+      }
+    }
+    material_ids.resize(num_faces);
+    for (size_t i = 0; i < num_faces; i++)
+    {
+      material_ids[i] = static_cast<uint32_t>(
+          face_materials[i] < 0 ? material_id : scene_ids[face_materials[i]]);
+    }
+    return true;
   }
-  std::vector<Triangle> load_obj(std::string inputfile, int material_id = 7)
+  /** Load the faces of an OBJ file as an indexed mesh. The first load
+      converts the file to a MeshFile next to it, and later loads copy the
+      mesh out of that instead of parsing the OBJ again, until the OBJ
+      changes. The copy is one bulk memcpy per buffer; the mesh owns its
+      buffers since the BVH builds rewrite the indices in place and scenes
+      append meshes to each other.
+      \param[in] inputfile The OBJ file.
+      \param[in] material_id The material of every face usemtl_materials
+      does not assign one.
+      \param[in] use_mesh_file Whether to read and write the mesh file.
+      \param[in] usemtl_materials The scene material of the faces after a
+      usemtl of each name. Empty by default, which gives every face
+      material_id.
+      \param[in] num_materials The size of the scene's material table.
+      \return The mesh, or an empty one if the file cannot be read or parsed
+      or a material falls outside the table. The error is logged.
+  */
+  TriangleMesh load_obj(std::string inputfile, int material_id = 7,
+                        bool use_mesh_file = true,
+                        const MaterialMap &usemtl_materials = {},
+                        size_t num_materials =
+                            std::numeric_limits<size_t>::max())
   {
-
-    tinyobj::ObjReaderConfig reader_config;
-    std::vector<Triangle> ret;
-    tinyobj::ObjReader reader;
-
-    if (!reader.ParseFromFile(inputfile, reader_config))
+    const auto start = std::chrono::steady_clock::now();
+    const std::string mesh_path = MeshFile::path_for(inputfile);
+    TriangleMesh ret;
+    MeshFile mesh;
+    if (use_mesh_file && mesh.open(mesh_path, inputfile))
     {
-      if (!reader.Error().empty())
+      ret.vertices.assign(mesh.vertices(),
+                          mesh.vertices() + mesh.num_vertices());
+      ret.indices.assign(mesh.indices(),
+                         mesh.indices() + 3 * mesh.num_faces());
+      if (!assign_face_materials(mesh.face_materials(), mesh.num_faces(),
+                                 mesh.material_names(), material_id,
+                                 usemtl_materials, num_materials,
+                                 ret.material_ids))
       {
-       spdlog::error("TinyObjReader: {}", reader.Warning().c_str());
+        return {};
       }
-      exit(1);
+      const std::chrono::duration<double, std::milli> elapsed =
+          std::chrono::steady_clock::now() - start;
+      spdlog::info("Loaded {} triangles from the mesh file {} in {:.1f} ms",
+                   ret.size(), mesh_path, elapsed.count());
+      return ret;
     }
 
-    if (!reader.Warning().empty())
+    std::vector<int32_t> face_materials;
+    std::vector<std::string> material_names;
+    if (!ObjParser::parse(inputfile, ret.vertices, ret.indices,
+                          face_materials, material_names))
     {
-      spdlog::warn("TinyObjReader: {}", reader.Warning().c_str());
+      return {};
     }
-
-    auto &attrib = reader.GetAttrib();
-    auto &shapes = reader.GetShapes();
-
-    // Loop over shapes
-    for (size_t s = 0; s < shapes.size(); s++)
+    if (use_mesh_file)
     {
-      // Loop over faces(polygon)
-      size_t index_offset = 0;
-      for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++)
-      {
-        size_t fv = size_t(shapes[s].mesh.num_face_vertices[f]);
-        Triangle tri;
-        tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + 0];
-        tri.v0 = Vec3f(attrib.vertices[3 * size_t(idx.vertex_index) + 0],
-                       attrib.vertices[3 * size_t(idx.vertex_index) + 1],
-                       attrib.vertices[3 * size_t(idx.vertex_index) + 2]);
-        idx = shapes[s].mesh.indices[index_offset + 1];
-        tri.v1 = Vec3f(attrib.vertices[3 * size_t(idx.vertex_index) + 0],
-                       attrib.vertices[3 * size_t(idx.vertex_index) + 1],
-                       attrib.vertices[3 * size_t(idx.vertex_index) + 2]);
-
-        idx = shapes[s].mesh.indices[index_offset + 2];
-        tri.v2 = Vec3f(attrib.vertices[3 * size_t(idx.vertex_index) + 0],
-                        attrib.vertices[3 * size_t(idx.vertex_index) + 1],
-                        attrib.vertices[3 * size_t(idx.vertex_index) + 2]);
-        tri.face_normal = cal_face_normal(tri.v0, tri.v1, tri.v2);
-        tri.emission = Vec3f(0, 0, 0);
-        tri.material_id = material_id;
-        ret.push_back(tri);
-        index_offset += fv;
-        // per-face material
-        shapes[s].mesh.material_ids[f];
-      }
+      MeshFile::save(mesh_path, inputfile, ret.vertices, ret.indices,
+                     face_materials, material_names);
+    }
+    if (!assign_face_materials(face_materials.data(), face_materials.size(),
+                               material_names, material_id, usemtl_materials,
+                               num_materials, ret.material_ids))
+    {
+      return {};
     }
     return ret;
   }
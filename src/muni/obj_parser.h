@@ -0,0 +1,303 @@
+#pragma once
+#include "common.h"
+#include "mapped_file.h"
+#include "parallel.h"
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace muni {
+
+/** A parser for the geometry of Wavefront OBJ files that maps the file, splits
+    it into line-aligned chunks and parses the chunks on all worker threads.
+    It reads vertex positions (v), faces (f) and material switches (usemtl)
+    and skips everything else, such as normals, texture coordinates, groups
+    and smoothing groups. Polygons are split into triangle fans, which is
+    exact for the convex polygons exporters write. The .mtl library is not
+    read, so materials are numbered in the order the file first uses them.
+*/
+struct ObjParser {
+    // Smaller files are not worth the threads
+    static constexpr uint64_t min_chunk_bytes = 1 << 20;
+
+    /** Parse an OBJ file into an indexed mesh. Errors are logged with the
+        line they were found on.
+        \param[in] path The OBJ file.
+        \param[out] vertices The vertex positions.
+        \param[out] indices Three indices into vertices per face.
+        \param[out] face_materials The material of each face, an index into
+        material_names, or -1 for faces before the first usemtl.
+        \param[out] material_names The usemtl names in order of first use.
+        \return False if the file cannot be read, is malformed or has no
+        faces.
+    */
+    static bool parse(const std::string &path, std::vector<Vec3f> &vertices,
+                      std::vector<uint32_t> &indices,
+                      std::vector<int32_t> &face_materials,
+                      std::vector<std::string> &material_names) {
+        const auto start = std::chrono::steady_clock::now();
+        MappedFile file;
+        if (!file.open(path)) {
+            spdlog::error("Cannot open the OBJ file {}", path);
+            return false;
+        }
+        const char *text = reinterpret_cast<const char *>(file.data());
+        const uint64_t size = file.size();
+
+        // Chunk boundaries are moved forward to the next line start, so no
+        // line is split between two chunks
+        const unsigned int num_chunks = static_cast<unsigned int>(
+            std::max<uint64_t>(1, std::min<uint64_t>(num_worker_threads(),
+                                                     size / min_chunk_bytes)));
+        std::vector<Chunk> chunks(num_chunks);
+        uint64_t chunk_begin = 0;
+        for (unsigned int c = 0; c < num_chunks; c++) {
+            uint64_t chunk_end = size;
+            if (c + 1 < num_chunks) {
+                chunk_end = std::max(chunk_begin, size * (c + 1) / num_chunks);
+                const void *newline = chunk_end < size
+                                          ? std::memchr(text + chunk_end, '\n',
+                                                        size - chunk_end)
+                                          : nullptr;
+                chunk_end =
+                    newline ? static_cast<const char *>(newline) - text + 1
+                            : size;
+            }
+            chunks[c].begin = text + chunk_begin;
+            chunks[c].end = text + chunk_end;
+            chunk_begin = chunk_end;
+        }
+
+        // Count lines and vertices first, so every chunk knows the line
+        // numbers and vertex indices it starts at
+        run_chunks(0, num_chunks, num_chunks,
+                   [&](unsigned int c, uint32_t, uint32_t) {
+                       count_lines(chunks[c]);
+                   });
+        uint64_t num_vertices = 0, num_lines = 0;
+        for (Chunk &chunk : chunks) {
+            chunk.first_vertex = num_vertices;
+            chunk.first_line = num_lines + 1;
+            num_vertices += chunk.num_vertices;
+            num_lines += chunk.num_lines;
+        }
+        if (num_vertices > std::numeric_limits<uint32_t>::max()) {
+            spdlog::error("{} has {} vertices, more than 32-bit indices can "
+                          "address",
+                          path, num_vertices);
+            return false;
+        }
+
+        // Vertices go straight to their final place, faces are gathered per
+        // chunk and stitched together below
+        vertices.resize(num_vertices);
+        run_chunks(0, num_chunks, num_chunks,
+                   [&](unsigned int c, uint32_t, uint32_t) {
+                       parse_chunk(chunks[c], vertices);
+                   });
+        for (const Chunk &chunk : chunks) {
+            if (!chunk.error.empty()) {
+                spdlog::error("{}:{}: {}", path, chunk.error_line,
+                              chunk.error);
+                return false;
+            }
+        }
+
+        // Number materials in order of first use. Faces before a chunk's
+        // first usemtl continue the material the chunk before ended with
+        std::unordered_map<std::string_view, int32_t> material_ids;
+        material_names.clear();
+        int32_t current_material = -1;
+        uint64_t num_faces = 0;
+        for (Chunk &chunk : chunks) {
+            chunk.first_face = num_faces;
+            num_faces += chunk.face_materials.size();
+            chunk.inherited_material = current_material;
+            chunk.material_ids.resize(chunk.materials.size());
+            for (size_t m = 0; m < chunk.materials.size(); m++) {
+                auto [it, inserted] = material_ids.try_emplace(
+                    chunk.materials[m],
+                    static_cast<int32_t>(material_ids.size()));
+                if (inserted) material_names.emplace_back(chunk.materials[m]);
+                chunk.material_ids[m] = it->second;
+            }
+            if (chunk.last_material >= 0)
+                current_material = chunk.material_ids[chunk.last_material];
+        }
+
+        if (num_faces == 0) {
+            spdlog::error("{}: no faces", path);
+            return false;
+        }
+        indices.resize(3 * num_faces);
+        face_materials.resize(num_faces);
+        run_chunks(0, num_chunks, num_chunks,
+                   [&](unsigned int c, uint32_t, uint32_t) {
+                       const Chunk &chunk = chunks[c];
+                       std::copy(chunk.indices.begin(), chunk.indices.end(),
+                                 indices.begin() + 3 * chunk.first_face);
+                       for (size_t f = 0; f < chunk.face_materials.size();
+                            f++) {
+                           const int32_t local = chunk.face_materials[f];
+                           face_materials[chunk.first_face + f] =
+                               local < 0 ? chunk.inherited_material
+                                         : chunk.material_ids[local];
+                       }
+                   });
+
+        const std::chrono::duration<double, std::milli> elapsed =
+            std::chrono::steady_clock::now() - start;
+        spdlog::info("Parsed {} ({} vertices, {} triangles) on {} threads in "
+                     "{:.1f} ms",
+                     path, num_vertices, num_faces, num_chunks,
+                     elapsed.count());
+        return true;
+    }
+
+private:
+    struct Chunk {
+        const char *begin;
+        const char *end;
+        uint64_t num_lines = 0;
+        uint64_t num_vertices = 0;
+        uint64_t first_line = 1;
+        uint64_t first_vertex = 0;
+        uint64_t first_face = 0;
+
+        std::vector<uint32_t> indices;
+        // Index into materials, or -1 before the chunk's first usemtl
+        std::vector<int32_t> face_materials;
+        // Material names in order of first use in the chunk, pointing into
+        // the mapped file
+        std::vector<std::string_view> materials;
+        int32_t last_material = -1;
+        // Filled in while stitching
+        std::vector<int32_t> material_ids;
+        int32_t inherited_material = -1;
+
+        std::string error;
+        uint64_t error_line = 0;
+    };
+
+    static bool is_space(char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+    }
+
+    static const char *skip_space(const char *p, const char *end) {
+        while (p < end && is_space(*p)) p++;
+        return p;
+    }
+
+    static const char *line_end(const char *p, const char *end) {
+        const void *newline = std::memchr(p, '\n', end - p);
+        return newline ? static_cast<const char *>(newline) : end;
+    }
+
+    /** The keyword a line starts with, and where its arguments start. */
+    static std::string_view keyword(const char *&p, const char *end) {
+        p = skip_space(p, end);
+        const char *begin = p;
+        while (p < end && !is_space(*p)) p++;
+        return std::string_view(begin, p - begin);
+    }
+
+    static void count_lines(Chunk &chunk) {
+        for (const char *p = chunk.begin; p < chunk.end;) {
+            const char *end = line_end(p, chunk.end);
+            if (keyword(p, end) == "v") chunk.num_vertices++;
+            chunk.num_lines++;
+            p = end == chunk.end ? end : end + 1;
+        }
+    }
+
+    static void parse_chunk(Chunk &chunk, std::vector<Vec3f> &vertices) {
+        uint64_t line = chunk.first_line;
+        uint64_t vertex = chunk.first_vertex;
+        std::vector<uint32_t> corners;
+        auto fail = [&](std::string message) {
+            chunk.error = std::move(message);
+            chunk.error_line = line;
+        };
+
+        for (const char *p = chunk.begin; p < chunk.end; line++) {
+            const char *end = line_end(p, chunk.end);
+            const std::string_view command = keyword(p, end);
+            if (command == "v") {
+                Vec3f position;
+                for (int axis = 0; axis < 3; axis++) {
+                    p = skip_space(p, end);
+                    // from_chars does not take the sign OBJ writers may put
+                    // in front of positive numbers
+                    if (p < end && *p == '+') p++;
+                    const auto [next, error] =
+                        std::from_chars(p, end, position[axis]);
+                    if (error != std::errc()) {
+                        fail("expected three vertex coordinates");
+                        return;
+                    }
+                    p = next;
+                }
+                vertices[vertex++] = position;
+            } else if (command == "f") {
+                corners.clear();
+                while (true) {
+                    p = skip_space(p, end);
+                    if (p == end || *p == '#') break;
+                    int64_t index = 0;
+                    const auto [next, error] = std::from_chars(p, end, index);
+                    if (error != std::errc() || index == 0) {
+                        fail("expected a vertex index");
+                        return;
+                    }
+                    // Negative indices count back from the last vertex read.
+                    // Either kind may only name vertices read before the face
+                    const int64_t resolved =
+                        index > 0 ? index - 1
+                                  : static_cast<int64_t>(vertex) + index;
+                    if (resolved < 0 ||
+                        resolved >= static_cast<int64_t>(vertex)) {
+                        fail("vertex index " + std::to_string(index) +
+                             " is out of range, " + std::to_string(vertex) +
+                             " vertices precede the face");
+                        return;
+                    }
+                    corners.push_back(static_cast<uint32_t>(resolved));
+                    // Skip the texture coordinate and normal indices
+                    p = next;
+                    while (p < end && !is_space(*p)) p++;
+                }
+                if (corners.size() < 3) {
+                    fail("a face needs at least three vertices");
+                    return;
+                }
+                for (size_t i = 1; i + 1 < corners.size(); i++) {
+                    chunk.indices.push_back(corners[0]);
+                    chunk.indices.push_back(corners[i]);
+                    chunk.indices.push_back(corners[i + 1]);
+                    chunk.face_materials.push_back(chunk.last_material);
+                }
+            } else if (command == "usemtl") {
+                p = skip_space(p, end);
+                const char *name_end = end;
+                while (name_end > p && is_space(name_end[-1])) name_end--;
+                const std::string_view name(p, name_end - p);
+                auto it = std::find(chunk.materials.begin(),
+                                    chunk.materials.end(), name);
+                if (it == chunk.materials.end())
+                    it = chunk.materials.insert(it, name);
+                chunk.last_material =
+                    static_cast<int32_t>(it - chunk.materials.begin());
+            }
+            p = end == chunk.end ? end : end + 1;
+        }
+    }
+};
+
+}  // namespace muni
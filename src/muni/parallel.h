@@ -0,0 +1,77 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+namespace muni {
+
+/** Number of threads the builders spread their work over. */
+inline unsigned int num_worker_threads() {
+    const unsigned int n = std::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+}
+
+/** How many chunks parallel_chunks splits count elements into: at most one per
+    worker thread, each at least min_chunk_size elements.
+*/
+inline unsigned int num_chunks_for(uint32_t count, uint32_t min_chunk_size) {
+    return std::max(1u, std::min(num_worker_threads(),
+                                 count / std::max(min_chunk_size, 1u)));
+}
+
+/** Split [begin, end) into num_chunks contiguous chunks and run
+    fn(chunk, chunk_begin, chunk_end) on every chunk, each on its own thread.
+    The same arguments always give the same chunks, so passes over the same
+    range can share per-chunk state.
+    \param[in] begin The first index.
+    \param[in] end One past the last index.
+    \param[in] num_chunks How many chunks to split the range into.
+    \param[in] fn The work to do on every chunk.
+*/
+template<typename F>
+void run_chunks(uint32_t begin, uint32_t end, unsigned int num_chunks,
+                F &&fn) {
+    const uint32_t count = end - begin;
+    auto chunk_start = [&](unsigned int chunk) {
+        return begin +
+               static_cast<uint32_t>(uint64_t(count) * chunk / num_chunks);
+    };
+    if (num_chunks <= 1) {
+        fn(0u, begin, end);
+        return;
+    }
+
+    std::vector<std::thread> threads;
+    threads.reserve(num_chunks - 1);
+    for (unsigned int chunk = 1; chunk < num_chunks; chunk++) {
+        const uint32_t chunk_begin = chunk_start(chunk);
+        const uint32_t chunk_end = chunk_start(chunk + 1);
+        threads.emplace_back([&fn, chunk, chunk_begin, chunk_end] {
+            fn(chunk, chunk_begin, chunk_end);
+        });
+    }
+    // The calling thread takes the first chunk itself
+    fn(0u, begin, chunk_start(1));
+    for (auto &thread : threads) thread.join();
+}
+
+/** Split [begin, end) into at most num_worker_threads() contiguous chunks of at
+    least min_chunk_size elements and run fn(chunk, chunk_begin, chunk_end) on
+    every chunk, each on its own thread. Chunk indices are dense and ordered
+    like the ranges, so per-chunk partial results can be reduced in order.
+    \param[in] begin The first index.
+    \param[in] end One past the last index.
+    \param[in] min_chunk_size The smallest range worth a thread.
+    \param[in] fn The work to do on every chunk.
+    \return The number of chunks fn was called with.
+*/
+template<typename F>
+unsigned int parallel_chunks(uint32_t begin, uint32_t end,
+                             uint32_t min_chunk_size, F &&fn) {
+    const unsigned int num_chunks = num_chunks_for(end - begin, min_chunk_size);
+    run_chunks(begin, end, num_chunks, fn);
+    return num_chunks;
+}
+
+}  // namespace muni
@@ -0,0 +1,47 @@
+#pragma once
+#include "common.h"
+#include <cmath>
+#include <cstdint>
+
+namespace muni {
+/** A ray together with everything the traversal needs that depends only on
+    the ray: the inverse direction and direction signs for slab tests, and the
+    axis permutation and shear constants of the watertight triangle test.
+*/
+struct Ray {
+    Ray(Vec3f origin, Vec3f direction)
+        : origin(origin), direction(direction), inv_direction(1.f / direction) {
+        for (int i = 0; i < 3; i++) dir_is_neg[i] = std::signbit(direction[i]);
+
+        // Permute the axes so that the dominant direction component becomes z
+        const Vec3f abs_direction = abs(direction);
+        kz = 0;
+        if (abs_direction[1] > abs_direction[0] &&
+            abs_direction[1] > abs_direction[2])
+            kz = 1;
+        if (abs_direction[2] > abs_direction[0] &&
+            abs_direction[2] > abs_direction[1])
+            kz = 2;
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        // and keep the winding of the triangles
+        if (direction[kz] < 0.0f) {
+            unsigned int swap = kx;
+            kx = ky;
+            ky = swap;
+        }
+
+        // Shear that maps the direction onto the unit z axis
+        Sx = direction[kx] / direction[kz];
+        Sy = direction[ky] / direction[kz];
+        Sz = 1.f / direction[kz];
+    }
+
+    Vec3f origin;
+    Vec3f direction;
+    Vec3f inv_direction;
+    uint8_t dir_is_neg[3];
+    unsigned int kx, ky, kz;
+    float Sx, Sy, Sz;
+};
+}  // namespace muni
@@ -14,6 +14,8 @@ static const float light_len_y = 0.16f;
 static const float inv_light_area = 1 / (light_len_x * light_len_y);
 static const Vec3f light_color{50.0f, 50.0f, 50.0f};
 static const Vec3f light_normal{0.0f, 0.0f, -1.0f};
+// Meshes do not store emission, so the light is told apart by its material
+static const unsigned int light_material_id = 6;
 
 // Microfacet materials
 const Dielectric Glass{.eta = 1.5f, .roughness = 0.25f};
@@ -29,7 +31,9 @@ static const std::array<std::variant<Lambertian, Dielectric>, 7> materials = {
     // Top
     Lambertian{.albedo = Vec3f{0.874000013f, 0.874000013f, 0.875000000f}},
     // Bunny
-    Glass
+    Glass,
+    // Light, which is never shaded
+    Lambertian{}
 };
 
 static std::vector<Triangle> triangles = {
@@ -39,13 +43,13 @@ static std::vector<Triangle> triangles = {
              .v2 = Vec3f{light_x, light_y, light_z},
              .face_normal = Vec3f{0.0f, 0.0f, -1.0f},
              .emission = light_color,
-             .material_id = 0},
+             .material_id = light_material_id},
     Triangle{.v0 = Vec3f{light_x, light_y + light_len_y, light_z},
              .v1 = Vec3f{light_x + light_len_x, light_y + light_len_y, light_z},
              .v2 = Vec3f{light_x + light_len_x, light_y, light_z},
              .face_normal = Vec3f{0.0f, 0.0f, -1.0f},
              .emission = light_color,
-             .material_id = 0},
+             .material_id = light_material_id},
     // Back
     Triangle{.v0 = Vec3f{0.000000133f, -0.559199989f, 0.548799932f},
              .v1 = Vec3f{0.555999935f, -0.559199989f, 0.000000040f},
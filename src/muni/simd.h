@@ -0,0 +1,203 @@
+#pragma once
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#define MUNI_SSE 1
+#endif
+#if defined(__AVX__)
+#define MUNI_AVX 1
+#endif
+
+namespace muni { namespace simd {
+
+/** N floats processed in lock step. The generic version is a plain array the
+    compiler may auto-vectorize; vfloat<4> maps to SSE and vfloat<8> to AVX
+    when the target supports them. Only the handful of operations the
+    intersectors need are provided, and they are IEEE identical to the scalar
+    ones (no FMA contraction), so SIMD and scalar code agree bit for bit.
+*/
+template<int N> struct vfloat {
+    float v[N];
+
+    static vfloat broadcast(float x) {
+        vfloat r;
+        for (int i = 0; i < N; i++) r.v[i] = x;
+        return r;
+    }
+    static vfloat load(const float *p) {
+        vfloat r;
+        for (int i = 0; i < N; i++) r.v[i] = p[i];
+        return r;
+    }
+    // Convert N unsigned bytes
+    static vfloat load_bytes(const uint8_t *p) {
+        vfloat r;
+        for (int i = 0; i < N; i++) r.v[i] = float(p[i]);
+        return r;
+    }
+    void store(float *p) const {
+        for (int i = 0; i < N; i++) p[i] = v[i];
+    }
+};
+
+/** Result of a lane-wise comparison, one bit per lane in movemask(). */
+template<int N> struct vmask {
+    bool m[N];
+
+    int movemask() const {
+        int bits = 0;
+        for (int i = 0; i < N; i++) bits |= int(m[i]) << i;
+        return bits;
+    }
+};
+
+#define MUNI_SIMD_GENERIC_ARITH(op)                                            \
+    template<int N> vfloat<N> operator op(const vfloat<N> &a,                  \
+                                          const vfloat<N> &b) {                \
+        vfloat<N> r;                                                           \
+        for (int i = 0; i < N; i++) r.v[i] = a.v[i] op b.v[i];                 \
+        return r;                                                              \
+    }
+MUNI_SIMD_GENERIC_ARITH(+)
+MUNI_SIMD_GENERIC_ARITH(-)
+MUNI_SIMD_GENERIC_ARITH(*)
+MUNI_SIMD_GENERIC_ARITH(/)
+#undef MUNI_SIMD_GENERIC_ARITH
+
+#define MUNI_SIMD_GENERIC_CMP(op)                                              \
+    template<int N> vmask<N> operator op(const vfloat<N> &a,                   \
+                                         const vfloat<N> &b) {                 \
+        vmask<N> r;                                                            \
+        for (int i = 0; i < N; i++) r.m[i] = a.v[i] op b.v[i];                 \
+        return r;                                                              \
+    }
+MUNI_SIMD_GENERIC_CMP(<)
+MUNI_SIMD_GENERIC_CMP(>)
+MUNI_SIMD_GENERIC_CMP(<=)
+MUNI_SIMD_GENERIC_CMP(>=)
+MUNI_SIMD_GENERIC_CMP(==)
+#undef MUNI_SIMD_GENERIC_CMP
+
+template<int N> vmask<N> operator&(const vmask<N> &a, const vmask<N> &b) {
+    vmask<N> r;
+    for (int i = 0; i < N; i++) r.m[i] = a.m[i] && b.m[i];
+    return r;
+}
+template<int N> vmask<N> operator|(const vmask<N> &a, const vmask<N> &b) {
+    vmask<N> r;
+    for (int i = 0; i < N; i++) r.m[i] = a.m[i] || b.m[i];
+    return r;
+}
+template<int N> vmask<N> operator!(const vmask<N> &a) {
+    vmask<N> r;
+    for (int i = 0; i < N; i++) r.m[i] = !a.m[i];
+    return r;
+}
+template<int N> vfloat<N> min(const vfloat<N> &a, const vfloat<N> &b) {
+    vfloat<N> r;
+    for (int i = 0; i < N; i++) r.v[i] = b.v[i] < a.v[i] ? b.v[i] : a.v[i];
+    return r;
+}
+template<int N> vfloat<N> max(const vfloat<N> &a, const vfloat<N> &b) {
+    vfloat<N> r;
+    for (int i = 0; i < N; i++) r.v[i] = a.v[i] < b.v[i] ? b.v[i] : a.v[i];
+    return r;
+}
+
+#ifdef MUNI_SSE
+template<> struct vfloat<4> {
+    __m128 v;
+
+    static vfloat broadcast(float x) { return {_mm_set1_ps(x)}; }
+    static vfloat load(const float *p) { return {_mm_loadu_ps(p)}; }
+    static vfloat load_bytes(const uint8_t *p) {
+#ifdef __SSE4_1__
+        const __m128i bytes = _mm_cvtsi32_si128(*reinterpret_cast<const int *>(p));
+        return {_mm_cvtepi32_ps(_mm_cvtepu8_epi32(bytes))};
+#else
+        return {_mm_setr_ps(p[0], p[1], p[2], p[3])};
+#endif
+    }
+    void store(float *p) const { _mm_storeu_ps(p, v); }
+};
+template<> struct vmask<4> {
+    __m128 m;
+
+    int movemask() const { return _mm_movemask_ps(m); }
+};
+inline vfloat<4> operator+(vfloat<4> a, vfloat<4> b) { return {_mm_add_ps(a.v, b.v)}; }
+inline vfloat<4> operator-(vfloat<4> a, vfloat<4> b) { return {_mm_sub_ps(a.v, b.v)}; }
+inline vfloat<4> operator*(vfloat<4> a, vfloat<4> b) { return {_mm_mul_ps(a.v, b.v)}; }
+inline vfloat<4> operator/(vfloat<4> a, vfloat<4> b) { return {_mm_div_ps(a.v, b.v)}; }
+inline vmask<4> operator<(vfloat<4> a, vfloat<4> b) { return {_mm_cmplt_ps(a.v, b.v)}; }
+inline vmask<4> operator>(vfloat<4> a, vfloat<4> b) { return {_mm_cmpgt_ps(a.v, b.v)}; }
+inline vmask<4> operator<=(vfloat<4> a, vfloat<4> b) { return {_mm_cmple_ps(a.v, b.v)}; }
+inline vmask<4> operator>=(vfloat<4> a, vfloat<4> b) { return {_mm_cmpge_ps(a.v, b.v)}; }
+inline vmask<4> operator==(vfloat<4> a, vfloat<4> b) { return {_mm_cmpeq_ps(a.v, b.v)}; }
+inline vmask<4> operator&(vmask<4> a, vmask<4> b) { return {_mm_and_ps(a.m, b.m)}; }
+inline vmask<4> operator|(vmask<4> a, vmask<4> b) { return {_mm_or_ps(a.m, b.m)}; }
+inline vmask<4> operator!(vmask<4> a) {
+    return {_mm_xor_ps(a.m, _mm_castsi128_ps(_mm_set1_epi32(-1)))};
+}
+// Operand order matches the generic version: NaN lanes take the first operand
+inline vfloat<4> min(vfloat<4> a, vfloat<4> b) { return {_mm_min_ps(b.v, a.v)}; }
+inline vfloat<4> max(vfloat<4> a, vfloat<4> b) { return {_mm_max_ps(b.v, a.v)}; }
+#endif
+
+#ifdef MUNI_AVX
+template<> struct vfloat<8> {
+    __m256 v;
+
+    static vfloat broadcast(float x) { return {_mm256_set1_ps(x)}; }
+    static vfloat load(const float *p) { return {_mm256_loadu_ps(p)}; }
+    static vfloat load_bytes(const uint8_t *p) {
+#ifdef __AVX2__
+        const __m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p));
+        return {_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes))};
+#else
+        return {_mm256_setr_ps(p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7])};
+#endif
+    }
+    void store(float *p) const { _mm256_storeu_ps(p, v); }
+};
+template<> struct vmask<8> {
+    __m256 m;
+
+    int movemask() const { return _mm256_movemask_ps(m); }
+};
+inline vfloat<8> operator+(vfloat<8> a, vfloat<8> b) { return {_mm256_add_ps(a.v, b.v)}; }
+inline vfloat<8> operator-(vfloat<8> a, vfloat<8> b) { return {_mm256_sub_ps(a.v, b.v)}; }
+inline vfloat<8> operator*(vfloat<8> a, vfloat<8> b) { return {_mm256_mul_ps(a.v, b.v)}; }
+inline vfloat<8> operator/(vfloat<8> a, vfloat<8> b) { return {_mm256_div_ps(a.v, b.v)}; }
+inline vmask<8> operator<(vfloat<8> a, vfloat<8> b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)}; }
+inline vmask<8> operator>(vfloat<8> a, vfloat<8> b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ)}; }
+inline vmask<8> operator<=(vfloat<8> a, vfloat<8> b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ)}; }
+inline vmask<8> operator>=(vfloat<8> a, vfloat<8> b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ)}; }
+inline vmask<8> operator==(vfloat<8> a, vfloat<8> b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_EQ_OQ)}; }
+inline vmask<8> operator&(vmask<8> a, vmask<8> b) { return {_mm256_and_ps(a.m, b.m)}; }
+inline vmask<8> operator|(vmask<8> a, vmask<8> b) { return {_mm256_or_ps(a.m, b.m)}; }
+inline vmask<8> operator!(vmask<8> a) {
+    return {_mm256_xor_ps(a.m, _mm256_castsi256_ps(_mm256_set1_epi32(-1)))};
+}
+inline vfloat<8> min(vfloat<8> a, vfloat<8> b) { return {_mm256_min_ps(b.v, a.v)}; }
+inline vfloat<8> max(vfloat<8> a, vfloat<8> b) { return {_mm256_max_ps(b.v, a.v)}; }
+#endif
+
+/** Hint that the cache line holding p will be read soon. */
+inline void prefetch(const void *p) {
+#ifdef MUNI_SSE
+    _mm_prefetch(static_cast<const char *>(p), _MM_HINT_T0);
+#else
+    (void)p;
+#endif
+}
+
+// Widest packet the target handles natively
+#ifdef MUNI_AVX
+constexpr int native_width = 8;
+#else
+constexpr int native_width = 4;
+#endif
+
+}}  // namespace muni::simd
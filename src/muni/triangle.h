@@ -1,15 +1,27 @@
 #pragma once
 #include "common.h"
 #include "math_helpers.h"
+#include "ray.h"
+#include <cstdint>
+#include <limits>
 #include <tuple>
 
 namespace muni {
+/** The corners of a triangle, which is all that intersection tests and bounds
+    read. TriangleMesh hands its faces out as these.
+*/
+struct TriangleVertices {
+    Vec3f v0, v1, v2;
+};
+
 struct Triangle {
     Vec3f v0, v1, v2;
     Vec3f face_normal;
     Vec3f emission;
     unsigned int material_id;
 
+    operator TriangleVertices() const { return {v0, v1, v2}; }
+
     /** Ray-Triangle intersection based on "Watertight Ray/Triangle Intersection"
         Paper link: http://jcgt.org/published/0002/01/05/paper.pdf
         \param[in] tri The triangle to intersect with.
@@ -18,36 +30,28 @@ struct Triangle {
         \param[in] t_min The minimum t value of the intersection point along the ray.
         \param[in] t_max The maximum t value of the intersection point along the ray.
         \return A tuple containing a boolean indicating whether the ray intersects
-        the triangle, and the t value of the intersection point along the ray.
+        the triangle, the t value of the intersection point along the ray, and
+        the barycentric weights of v1 and v2 at the intersection point.
     */
-    static std::tuple<bool, float>
-    ray_triangle_intersect(Triangle tri, Vec3f ray_origin, Vec3f ray_direction,
-                           float t_min, float t_max) {
-        const Vec3f abs_ray_direction = abs(ray_direction);
-        unsigned int axis = 0;
-        if (abs_ray_direction[1] > abs_ray_direction[0] &&
-            abs_ray_direction[1] > abs_ray_direction[2])
-            axis = 1;
-        if (abs_ray_direction[2] > abs_ray_direction[0] &&
-            abs_ray_direction[2] > abs_ray_direction[1])
-            axis = 2;
-
-        unsigned int kz = axis;
-        unsigned int kx = (kz + 1) % 3;
-        unsigned int ky = (kx + 1) % 3;
-        if (ray_direction[kz] < 0.0f) {
-            unsigned int swap = kx;
-            kx = ky;
-            ky = swap;
-        }
+    static std::tuple<bool, float, Vec2f>
+    ray_triangle_intersect(const TriangleVertices &tri, Vec3f ray_origin,
+                           Vec3f ray_direction, float t_min, float t_max) {
+        return ray_triangle_intersect(tri, Ray(ray_origin, ray_direction),
+                                      t_min, t_max);
+    }
 
-        float Sx = ray_direction[kx] / ray_direction[kz];
-        float Sy = ray_direction[ky] / ray_direction[kz];
-        float Sz = 1.f / ray_direction[kz];
+    /** Same as above, but with the per-ray permutation and shear already
+        computed, which is what traversal loops should call.
+    */
+    static std::tuple<bool, float, Vec2f>
+    ray_triangle_intersect(const TriangleVertices &tri, const Ray &ray,
+                           float t_min, float t_max) {
+        const unsigned int kx = ray.kx, ky = ray.ky, kz = ray.kz;
+        const float Sx = ray.Sx, Sy = ray.Sy, Sz = ray.Sz;
 
-        const Vec3f A = tri.v0 - ray_origin;
-        const Vec3f B = tri.v1 - ray_origin;
-        const Vec3f C = tri.v2 - ray_origin;
+        const Vec3f A = tri.v0 - ray.origin;
+        const Vec3f B = tri.v1 - ray.origin;
+        const Vec3f C = tri.v2 - ray.origin;
 
         const float Ax = A[kx] - Sx * A[kz];
         const float Ay = A[ky] - Sy * A[kz];
@@ -73,10 +77,10 @@ struct Triangle {
         }
 
         if ((U < 0.f || V < 0.f || W < 0.f) && (U > 0.f || V > 0.f || W > 0.f))
-            return {false, 0.0f};
+            return {false, 0.0f, Vec2f{0.0f}};
 
         float det = U + V + W;
-        if (det == 0.f) return {false, 0.0f};
+        if (det == 0.f) return {false, 0.0f, Vec2f{0.0f}};
 
         const float Az = Sz * A[kz];
         const float Bz = Sz * B[kz];
@@ -87,10 +91,26 @@ struct Triangle {
         const float t = T * rcp_det;
         const Vec3f barycentrics = Vec3f(U, V, W) * rcp_det;
 
-        if (t < t_min || t > t_max) return {false, 0.0f};
+        if (t < t_min || t > t_max) return {false, 0.0f, Vec2f{0.0f}};
 
-        return {true, t};
+        return {true, t, Vec2f(barycentrics[1], barycentrics[2])};
     }
 };
 
+/** The result of a closest-hit query. Only the triangle index is kept, the
+    triangle itself is looked up once the final hit is known.
+*/
+struct HitRecord {
+    static constexpr uint32_t invalid_idx = std::numeric_limits<uint32_t>::max();
+
+    float t = std::numeric_limits<float>::infinity();
+    uint32_t triangle_idx = invalid_idx;
+    // Barycentric weights of v1 and v2, the weight of v0 is 1 - u - v
+    Vec2f barycentrics = Vec2f{0.0f};
+    // The instance that was hit, when tracing a TopLevel
+    uint32_t instance_idx = invalid_idx;
+
+    bool is_hit() const { return triangle_idx != invalid_idx; }
+};
+
 }  // namespace muni
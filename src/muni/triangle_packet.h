@@ -0,0 +1,150 @@
+#pragma once
+#include "common.h"
+#include "mesh.h"
+#include "ray.h"
+#include "simd.h"
+#include "triangle.h"
+#include <bit>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace muni {
+/** Up to N triangles stored structure-of-arrays, so the watertight test runs
+    on all of them at once. Unused lanes repeat the last triangle, which can
+    only ever produce a duplicate of a hit that lane already reports.
+*/
+template<int N> struct TrianglePacket {
+    static constexpr int width = N;
+
+    // vertices[k][axis][lane]: coordinate axis of vertex k of every lane
+    float vertices[3][3][N];
+    uint32_t triangle_idx[N];
+
+    /** Gather up to N triangles into a packet.
+        \param[in] triangles The mesh the indices refer to.
+        \param[in] indices The indices of the triangles to pack.
+        \param[in] count How many indices to take, between 1 and N.
+    */
+    static TrianglePacket pack(const TriangleMesh &triangles,
+                               const uint32_t *indices, int count) {
+        TrianglePacket packet;
+        for (int lane = 0; lane < N; lane++) {
+            const uint32_t tri_idx = indices[lane < count ? lane : count - 1];
+            const TriangleVertices tri = triangles[tri_idx];
+            for (int axis = 0; axis < 3; axis++) {
+                packet.vertices[0][axis][lane] = tri.v0[axis];
+                packet.vertices[1][axis][lane] = tri.v1[axis];
+                packet.vertices[2][axis][lane] = tri.v2[axis];
+            }
+            packet.triangle_idx[lane] = tri_idx;
+        }
+        return packet;
+    }
+
+    /** Watertight test of all lanes against one ray. Every operation mirrors
+        Triangle::ray_triangle_intersect, including the double precision
+        fallback for lanes where an edge function is exactly zero, so a ray
+        through a shared edge hits exactly the triangles the scalar test hits.
+        \param[in] ray The ray, with its traversal data precomputed.
+        \param[in] t_min The minimum t value of the intersection point.
+        \param[in] t_max The maximum t value of the intersection point.
+        \param[out] t The t value of every lane.
+        \param[out] barycentrics The v1 and v2 weights of every lane.
+        \return A bit mask of the lanes that hit.
+    */
+    int intersect_lanes(const Ray &ray, float t_min, float t_max, float *t,
+                        float (*barycentrics)[N]) const {
+        using vf = simd::vfloat<N>;
+        const unsigned int kx = ray.kx, ky = ray.ky, kz = ray.kz;
+        const vf Sx = vf::broadcast(ray.Sx), Sy = vf::broadcast(ray.Sy),
+                 Sz = vf::broadcast(ray.Sz);
+        const vf Ox = vf::broadcast(ray.origin[kx]),
+                 Oy = vf::broadcast(ray.origin[ky]),
+                 Oz = vf::broadcast(ray.origin[kz]);
+
+        const vf A_z = vf::load(vertices[0][kz]) - Oz;
+        const vf B_z = vf::load(vertices[1][kz]) - Oz;
+        const vf C_z = vf::load(vertices[2][kz]) - Oz;
+        const vf Ax = (vf::load(vertices[0][kx]) - Ox) - Sx * A_z;
+        const vf Ay = (vf::load(vertices[0][ky]) - Oy) - Sy * A_z;
+        const vf Bx = (vf::load(vertices[1][kx]) - Ox) - Sx * B_z;
+        const vf By = (vf::load(vertices[1][ky]) - Oy) - Sy * B_z;
+        const vf Cx = (vf::load(vertices[2][kx]) - Ox) - Sx * C_z;
+        const vf Cy = (vf::load(vertices[2][ky]) - Oy) - Sy * C_z;
+
+        vf U = Cx * By - Cy * Bx;
+        vf V = Ax * Cy - Ay * Cx;
+        vf W = Bx * Ay - By * Ax;
+
+        const vf zero = vf::broadcast(0.f);
+        const int on_edge =
+            ((U == zero) | (V == zero) | (W == zero)).movemask();
+        if (on_edge) {
+            // Redo the lanes that sit exactly on an edge in double precision
+            float ax[N], ay[N], bx[N], by[N], cx[N], cy[N], u[N], v[N], w[N];
+            Ax.store(ax), Ay.store(ay), Bx.store(bx), By.store(by);
+            Cx.store(cx), Cy.store(cy);
+            U.store(u), V.store(v), W.store(w);
+            for (int lane = 0; lane < N; lane++) {
+                if (!(on_edge & (1 << lane))) continue;
+                u[lane] = (float)(double(cx[lane]) * double(by[lane]) -
+                                  double(cy[lane]) * double(bx[lane]));
+                v[lane] = (float)(double(ax[lane]) * double(cy[lane]) -
+                                  double(ay[lane]) * double(cx[lane]));
+                w[lane] = (float)(double(bx[lane]) * double(ay[lane]) -
+                                  double(by[lane]) * double(ax[lane]));
+            }
+            U = vf::load(u), V = vf::load(v), W = vf::load(w);
+        }
+
+        const vf det = U + V + W;
+        const vf Az = Sz * A_z, Bz = Sz * B_z, Cz = Sz * C_z;
+        const vf T = U * Az + V * Bz + W * Cz;
+        const vf rcp_det = vf::broadcast(1.f) / det;
+        const vf t_hit = T * rcp_det;
+
+        const auto has_neg = (U < zero) | (V < zero) | (W < zero);
+        const auto has_pos = (U > zero) | (V > zero) | (W > zero);
+        const auto hit = (!(has_neg & has_pos)) & (!(det == zero)) &
+                         (t_hit >= vf::broadcast(t_min)) &
+                         (t_hit <= vf::broadcast(t_max));
+
+        t_hit.store(t);
+        (V * rcp_det).store(barycentrics[0]);
+        (W * rcp_det).store(barycentrics[1]);
+        return hit.movemask();
+    }
+
+    /** Closest hit among the lanes. Ties go to the later lane, like the
+        scalar loop over a leaf where an equal t replaces the current hit.
+        \return The closest hit, if any.
+    */
+    HitRecord intersect(const Ray &ray, float t_min, float t_max) const {
+        float t[N], barycentrics[2][N];
+        int hit_mask = intersect_lanes(ray, t_min, t_max, t, barycentrics);
+        HitRecord rec;
+        int best_lane = -1;
+        for (; hit_mask; hit_mask &= hit_mask - 1) {
+            const int lane = std::countr_zero(static_cast<unsigned>(hit_mask));
+            if (best_lane < 0 || t[lane] <= t[best_lane]) best_lane = lane;
+        }
+        if (best_lane < 0) return rec;
+        rec.t = t[best_lane];
+        rec.triangle_idx = triangle_idx[best_lane];
+        rec.barycentrics =
+            Vec2f(barycentrics[0][best_lane], barycentrics[1][best_lane]);
+        return rec;
+    }
+
+    /** Whether any lane hits within [t_min, t_max]. */
+    bool occluded(const Ray &ray, float t_min, float t_max) const {
+        float t[N], barycentrics[2][N];
+        return intersect_lanes(ray, t_min, t_max, t, barycentrics) != 0;
+    }
+};
+
+// Packet width used by the accelerators' leaves
+using LeafPacket = TrianglePacket<simd::native_width>;
+
+}  // namespace muni
@@ -0,0 +1,392 @@
+#pragma once
+#include "common.h"
+#include "bounding_box.h"
+#include "bvh.h"
+#include "ray.h"
+#include "simd.h"
+#include "triangle.h"
+#include "math_helpers.h"
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace muni { namespace RayTracer {
+
+/** A node of an N-wide BVH. The bounds of all children are stored
+    structure-of-arrays so one SIMD slab test checks every child at once.
+    Empty child slots have inverted infinite bounds and are never hit.
+*/
+template<int N> struct WideBVHNode {
+    // bounds_min[axis][child], bounds_max[axis][child]
+    float bounds_min[3][N];
+    float bounds_max[3][N];
+    // Interior child: node index. Leaf child: index of its first triangle.
+    uint32_t children[N];
+    // Zero for interior children and empty slots.
+    uint8_t num_triangles[N];
+};
+/** A WideBVHNode with its child bounds quantized to 8 bits within the
+    bounds of the node itself. Those bounds are not stored: they are the box
+    the node's lane in its parent dequantizes to, which traversal carries
+    down on its stack, or WideBVH::root_frame for the root.
+*/
+template<int N> struct QuantizedWideBVHNode {
+    QuantizedBoxes<N> boxes;
+    uint32_t children[N];
+    uint8_t num_triangles[N];
+};
+static_assert(BVH::max_leaf_triangles <= UINT8_MAX,
+              "wide BVH leaf sizes are stored in 8 bits");
+
+template<int N> struct WideBVH {
+    using Node = WideBVHNode<N>;
+    using QuantizedNode = QuantizedWideBVHNode<N>;
+
+    // Float nodes need no frame to test their children in
+    struct NoFrame {};
+
+    // The bounds of a quantized node on the traversal stack. Plain floats,
+    // as Vec3f members would zero the whole stack on every query
+    struct Frame {
+        float min_point[3];
+        float max_point[3];
+
+        static Frame from_box(const BoundingBox3f &box) {
+            return Frame{{box.min_point.x, box.min_point.y, box.min_point.z},
+                         {box.max_point.x, box.max_point.y, box.max_point.z}};
+        }
+        BoundingBox3f box() const {
+            return BoundingBox3f{
+                Vec3f{min_point[0], min_point[1], min_point[2]},
+                Vec3f{max_point[0], max_point[1], max_point[2]}};
+        }
+    };
+
+    template<typename FrameType> struct StackEntry {
+        float t_near;
+        uint32_t index;
+        // Non-zero if the entry is a leaf range instead of a node
+        uint32_t num_triangles;
+        // The bounds of the node, for quantized nodes
+        [[no_unique_address]] FrameType frame;
+    };
+
+    /** Slab test the ray against all children of a node at once.
+        \param[in] node The node whose children to test.
+        \param[in] frame The bounds of a quantized node.
+        \param[in] ray The ray, with its traversal data precomputed.
+        \param[in] t_max The maximum t value to consider.
+        \param[out] t_near The entry distance of every child.
+        \return A bit mask of the children the ray hits.
+    */
+    static int intersect_children(const Node &node, NoFrame, const Ray &ray,
+                                  float t_max, float *t_near) {
+        return ray_intersect_boxes<N>(node.bounds_min, node.bounds_max, ray,
+                                      t_max, t_near);
+    }
+
+    static int intersect_children(const QuantizedNode &node,
+                                  const Frame &frame, const Ray &ray,
+                                  float t_max, float *t_near) {
+        return node.boxes.ray_intersect(frame.box(), ray, t_max, t_near);
+    }
+
+    /** The frame of a node's child, see QuantizedWideBVHNode. */
+    static NoFrame child_frame(const Node &, NoFrame, int) { return {}; }
+
+    static Frame child_frame(const QuantizedNode &node, const Frame &frame,
+                             int lane) {
+        return Frame::from_box(node.boxes.get(frame.box(), lane));
+    }
+
+    /** Find the closest hit, visiting children nearest first.
+        \param[in] triangles The triangles, in the order build_wide_bvh left
+        them.
+        \param[in] ray The ray, with its traversal data precomputed.
+        \param[in] t_max The maximum t value to consider.
+        \return The closest hit, if any.
+    */
+    HitRecord wide_bvh_traversal(const TriangleMesh &triangles,
+                                 const Ray &ray, const float t_max) const {
+        if (quantize_bounds)
+            return traverse(quantized_nodes, Frame::from_box(root_frame),
+                            triangles, ray, t_max);
+        return traverse(nodes, NoFrame{}, triangles, ray, t_max);
+    }
+
+    /** Check whether anything blocks the ray before t_max - ANYHIT_EPS.
+        \param[in] triangles The triangles, in the order build_wide_bvh left
+        them.
+        \param[in] ray The ray, with its traversal data precomputed.
+        \param[in] t_max The distance to the target point.
+        \return True if the ray is blocked, false otherwise.
+    */
+    bool wide_bvh_occluded(const TriangleMesh &triangles,
+                           const Ray &ray, const float t_max) const {
+        if (quantize_bounds)
+            return occluded(quantized_nodes, Frame::from_box(root_frame),
+                            triangles, ray, t_max);
+        return occluded(nodes, NoFrame{}, triangles, ray, t_max);
+    }
+
+    /** Build a binary SAH BVH and collapse it into an N-wide one, by
+        repeatedly opening the child with the largest surface area until a
+        node has N children. The triangles are reordered in place into leaf
+        order, exactly as BVH::build_bvh does.
+        \param[in,out] triangles The triangles to build over.
+    */
+    void build_wide_bvh(TriangleMesh &triangles) {
+        nodes.clear();
+        quantized_nodes.clear();
+        root_frame = BoundingBox3f::empty();
+        num_leaf_node = num_interior_node = 0;
+
+        BVH binary;
+        binary.build_bvh(triangles);
+        if (binary.nodes.empty()) return;
+
+        const auto start = std::chrono::steady_clock::now();
+        nodes.reserve(binary.nodes.size() / (N - 1) + 1);
+        collapse(binary.nodes, 0);
+        if (quantize_bounds) quantize();
+        const std::chrono::duration<double, std::milli> elapsed =
+            std::chrono::steady_clock::now() - start;
+        spdlog::info("BVH{}: {} nodes, {} leaves, {:.1f} KiB, collapsed in "
+                     "{:.1f} ms",
+                     N, num_interior_node, num_leaf_node,
+                     memory_usage() / 1024.0, elapsed.count());
+    }
+
+    /** Bytes held by the node pool. */
+    size_t memory_usage() const {
+        return nodes.size() * sizeof(Node) +
+               quantized_nodes.size() * sizeof(QuantizedNode);
+    }
+
+    WideBVH() {}
+    WideBVH(TriangleMesh &triangles) { build_wide_bvh(triangles); }
+
+    // Collapsing never makes the tree deeper than the binary one, and every
+    // level pushes at most N - 1 entries on top of the one it popped
+    static constexpr int max_stack_size = BVH::max_stack_depth * (N - 1) + 1;
+
+    // Store child bounds as 8-bit offsets within the bounds of their parent,
+    // rounded outward, see QuantizedWideBVHNode. Set before build_wide_bvh.
+    bool quantize_bounds = false;
+    // The node pool, nodes or quantized_nodes depending on quantize_bounds
+    std::vector<Node> nodes;
+    std::vector<QuantizedNode> quantized_nodes;
+    // The bounds of the root, which the quantized root's children are
+    // quantized in
+    BoundingBox3f root_frame = BoundingBox3f::empty();
+    uint32_t num_leaf_node = 0;
+    uint32_t num_interior_node = 0;
+
+private:
+    template<typename NodeType, typename FrameType>
+    static HitRecord traverse(const std::vector<NodeType> &pool,
+                              const FrameType &root,
+                              const TriangleMesh &triangles,
+                              const Ray &ray, const float t_max) {
+        HitRecord rec;
+        rec.t = t_max;
+        if (pool.empty()) return rec;
+
+        StackEntry<FrameType> stack[max_stack_size];
+        int stack_size = 0;
+        stack[stack_size++] = StackEntry<FrameType>{0.f, 0, 0, root};
+        while (stack_size > 0) {
+            const StackEntry<FrameType> entry = stack[--stack_size];
+            if (entry.t_near > rec.t) continue;
+
+            if (entry.num_triangles > 0) {
+                for (uint32_t i = entry.index;
+                     i < entry.index + entry.num_triangles; i++) {
+                    auto [hit, t, barycentrics] =
+                        Triangle::ray_triangle_intersect(triangles[i], ray,
+                                                         EPS, rec.t);
+                    if (hit) rec = HitRecord{t, i, barycentrics};
+                }
+                continue;
+            }
+
+            const NodeType &node = pool[entry.index];
+            float t_near[N];
+            int hit_mask =
+                intersect_children(node, entry.frame, ray, rec.t, t_near);
+
+            // Sort the hit lanes far to near, so the nearest child is popped
+            // first, and only then build the entries with their frames
+            int hit_lanes[N];
+            int num_hit_children = 0;
+            for (; hit_mask; hit_mask &= hit_mask - 1) {
+                const int i = std::countr_zero(static_cast<unsigned>(hit_mask));
+                int j = num_hit_children++;
+                for (; j > 0 && t_near[hit_lanes[j - 1]] < t_near[i]; j--)
+                    hit_lanes[j] = hit_lanes[j - 1];
+                hit_lanes[j] = i;
+            }
+            for (int j = 0; j < num_hit_children; j++) {
+                const int i = hit_lanes[j];
+                stack[stack_size++] = StackEntry<FrameType>{
+                    t_near[i], node.children[i], node.num_triangles[i],
+                    node.num_triangles[i] == 0
+                        ? child_frame(node, entry.frame, i)
+                        : FrameType{}};
+            }
+        }
+        return rec;
+    }
+
+    template<typename NodeType, typename FrameType>
+    static bool occluded(const std::vector<NodeType> &pool,
+                         const FrameType &root, const TriangleMesh &triangles,
+                         const Ray &ray, const float t_max) {
+        if (pool.empty()) return false;
+
+        const float t_limit = t_max - ANYHIT_EPS;
+        StackEntry<FrameType> stack[max_stack_size];
+        int stack_size = 0;
+        stack[stack_size++] = StackEntry<FrameType>{0.f, 0, 0, root};
+        while (stack_size > 0) {
+            const StackEntry<FrameType> entry = stack[--stack_size];
+            const NodeType &node = pool[entry.index];
+            float t_near[N];
+            int hit_mask =
+                intersect_children(node, entry.frame, ray, t_limit, t_near);
+            for (; hit_mask; hit_mask &= hit_mask - 1) {
+                const int i = std::countr_zero(static_cast<unsigned>(hit_mask));
+                if (node.num_triangles[i] == 0) {
+                    stack[stack_size++] = StackEntry<FrameType>{
+                        0.f, node.children[i], 0,
+                        child_frame(node, entry.frame, i)};
+                    continue;
+                }
+                for (uint32_t j = node.children[i];
+                     j < node.children[i] + node.num_triangles[i]; j++) {
+                    if (std::get<0>(Triangle::ray_triangle_intersect(
+                            triangles[j], ray, EPS, t_limit)))
+                        return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    uint32_t collapse(const std::vector<BVHNode> &binary_nodes,
+                      uint32_t binary_idx) {
+        // Gather up to N binary subtrees, opening the largest interior one
+        std::array<uint32_t, N> slots;
+        int num_slots = 0;
+        slots[num_slots++] = binary_idx;
+        while (num_slots < N) {
+            int best = -1;
+            float best_area = -1.f;
+            for (int i = 0; i < num_slots; i++) {
+                const BVHNode &candidate = binary_nodes[slots[i]];
+                if (candidate.is_leaf()) continue;
+                const float area = candidate.bounds.surface_area();
+                if (area > best_area) {
+                    best_area = area;
+                    best = i;
+                }
+            }
+            if (best < 0) break;
+            const uint32_t opened = slots[best];
+            slots[best] = opened + 1;
+            slots[num_slots++] = binary_nodes[opened].offset;
+        }
+
+        const uint32_t node_idx = static_cast<uint32_t>(nodes.size());
+        nodes.push_back(empty_node());
+        num_interior_node++;
+        for (int i = 0; i < num_slots; i++) {
+            const BVHNode &child = binary_nodes[slots[i]];
+            for (int axis = 0; axis < 3; axis++) {
+                nodes[node_idx].bounds_min[axis][i] =
+                    child.bounds.min_point[axis];
+                nodes[node_idx].bounds_max[axis][i] =
+                    child.bounds.max_point[axis];
+            }
+            if (child.is_leaf()) {
+                nodes[node_idx].children[i] = child.offset;
+                nodes[node_idx].num_triangles[i] =
+                    static_cast<uint8_t>(child.num_triangles);
+                num_leaf_node++;
+            } else {
+                const uint32_t child_idx = collapse(binary_nodes, slots[i]);
+                nodes[node_idx].children[i] = child_idx;
+            }
+        }
+        return node_idx;
+    }
+
+    /** Replace the nodes by quantized ones. The root's children are framed
+        by their union, every other node's by the box its lane in the parent
+        dequantizes to, which contains the node's children since quantizing
+        rounds outward.
+    */
+    void quantize() {
+        quantized_nodes.resize(nodes.size());
+        // Collapsing adds every node before its children
+        std::vector<BoundingBox3f> frames(nodes.size());
+        for (size_t i = 0; i < nodes.size(); i++) {
+            const Node &node = nodes[i];
+            QuantizedNode &quantized = quantized_nodes[i];
+            std::array<BoundingBox3f, N> child_bounds;
+            for (int lane = 0; lane < N; lane++) {
+                for (int axis = 0; axis < 3; axis++) {
+                    child_bounds[lane].min_point[axis] =
+                        node.bounds_min[axis][lane];
+                    child_bounds[lane].max_point[axis] =
+                        node.bounds_max[axis][lane];
+                }
+            }
+            if (i == 0) {
+                root_frame = BoundingBox3f::empty();
+                for (const BoundingBox3f &bounds : child_bounds)
+                    root_frame.include(bounds);
+                frames[0] = root_frame;
+            }
+            quantized.boxes = QuantizedBoxes<N>::empty();
+            for (int lane = 0; lane < N; lane++) {
+                // Empty slots have inverted bounds and stay invalid
+                if (child_bounds[lane].min_point.x <=
+                    child_bounds[lane].max_point.x) {
+                    quantized.boxes.set(frames[i], lane, child_bounds[lane]);
+                    if (node.num_triangles[lane] == 0)
+                        frames[node.children[lane]] =
+                            quantized.boxes.get(frames[i], lane);
+                }
+                quantized.children[lane] = node.children[lane];
+                quantized.num_triangles[lane] = node.num_triangles[lane];
+            }
+        }
+        nodes.clear();
+        nodes.shrink_to_fit();
+    }
+
+    static Node empty_node() {
+        Node node;
+        const float inf = std::numeric_limits<float>::infinity();
+        for (int axis = 0; axis < 3; axis++) {
+            for (int i = 0; i < N; i++) {
+                node.bounds_min[axis][i] = inf;
+                node.bounds_max[axis][i] = -inf;
+            }
+        }
+        for (int i = 0; i < N; i++) {
+            node.children[i] = 0;
+            node.num_triangles[i] = 0;
+        }
+        return node;
+    }
+};
+
+using BVH4 = WideBVH<4>;
+using BVH8 = WideBVH<8>;
+
+}}  // namespace muni::RayTracer
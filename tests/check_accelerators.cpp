@@ -0,0 +1,252 @@
+// Traces random rays through every acceleration structure and compares the
+// closest hits and occlusion results with a brute-force loop over all
+// triangles. Exits with 1 on any mismatch.
+//   xmake run check_accelerators [mesh.obj]
+#include "instance.h"
+#include "mesh.h"
+#include "obj_loader.h"
+#include "ray_tracer.h"
+#include "scenes/box.h"
+#include "spdlog/spdlog.h"
+#include <cmath>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace muni;
+
+namespace {
+
+constexpr int num_rays = 4000;
+
+/** A soup of random triangles inside the box, small and large ones mixed,
+    so leaves overlap, triangles straddle split planes and the SBVH splits
+    references.
+*/
+TriangleMesh random_triangles(size_t count) {
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> unit(0.f, 1.f);
+    auto point = [&] {
+        return Vec3f{0.05f + 0.45f * unit(rng), -0.55f + 0.5f * unit(rng),
+                     0.05f + 0.45f * unit(rng)};
+    };
+    std::vector<Triangle> triangles;
+    for (size_t i = 0; i < count; i++) {
+        const Vec3f center = point();
+        const float size = i % 50 == 0 ? 0.2f : 0.01f;
+        Triangle tri{};
+        tri.v0 = center;
+        tri.v1 = center + size * (point() - center);
+        tri.v2 = center + size * (point() - center);
+        triangles.push_back(tri);
+    }
+    TriangleMesh mesh;
+    mesh.append(triangles);
+    return mesh;
+}
+
+/** The nearest t of any triangle, brute force. */
+float brute_force_closest(const TriangleMesh &mesh, Vec3f origin, Vec3f dir) {
+    float t_best = std::numeric_limits<float>::infinity();
+    for (size_t i = 0; i < mesh.size(); i++) {
+        const auto [hit, t, uv] = Triangle::ray_triangle_intersect(
+            mesh[i], origin, dir, EPS, t_best);
+        if (hit) t_best = t;
+    }
+    return t_best;
+}
+
+bool brute_force_any(const TriangleMesh &mesh, Vec3f origin, Vec3f dir,
+                     float t_max) {
+    for (size_t i = 0; i < mesh.size(); i++) {
+        const auto [hit, t, uv] = Triangle::ray_triangle_intersect(
+            mesh[i], origin, dir, EPS, t_max - ANYHIT_EPS);
+        if (hit) return true;
+    }
+    return false;
+}
+
+struct Query {
+    Vec3f origin;
+    Vec3f dir;
+    float t_closest;
+    // Half way to the closest hit, or a fixed distance on misses
+    float t_any;
+    bool any;
+};
+
+std::vector<Query> make_queries(const TriangleMesh &mesh) {
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> unit(0.f, 1.f);
+    std::vector<Query> queries(num_rays);
+    for (Query &query : queries) {
+        query.origin = Vec3f{0.05f + 0.45f * unit(rng),
+                             -0.5f + 0.45f * unit(rng),
+                             0.05f + 0.45f * unit(rng)};
+        const float z = 2.f * unit(rng) - 1.f;
+        const float phi = 6.2831853f * unit(rng);
+        const float r = std::sqrt(1.f - z * z);
+        query.dir = Vec3f{r * std::cos(phi), r * std::sin(phi), z};
+        query.t_closest = brute_force_closest(mesh, query.origin, query.dir);
+        query.t_any =
+            std::isinf(query.t_closest) ? 1.f : 0.5f * query.t_closest;
+        query.any =
+            brute_force_any(mesh, query.origin, query.dir, query.t_any);
+    }
+    return queries;
+}
+
+/** Run every query through one structure.
+    \param[in] label The structure, for the log.
+    \param[in] mesh The triangles, in the order the structure's build left
+    them.
+    \param[in] closest_hit The structure's closest hit query.
+    \param[in] any_hit The structure's occlusion query.
+    \return The number of wrong answers.
+*/
+int check(const std::string &label, const TriangleMesh &mesh,
+          const std::vector<Query> &queries,
+          const std::function<HitRecord(Vec3f, Vec3f)> &closest_hit,
+          const std::function<bool(Vec3f, Vec3f, float)> &any_hit) {
+    int num_wrong = 0;
+    for (const Query &query : queries) {
+        const HitRecord rec = closest_hit(query.origin, query.dir);
+        bool right = rec.is_hit() == !std::isinf(query.t_closest);
+        if (right && rec.is_hit()) {
+            // The reported triangle must be hit at the reported distance
+            const auto [hit, t, uv] = Triangle::ray_triangle_intersect(
+                mesh[rec.triangle_idx], query.origin, query.dir, EPS,
+                std::numeric_limits<float>::infinity());
+            right = std::abs(rec.t - query.t_closest) <=
+                        1e-5f * std::max(1.f, query.t_closest) &&
+                    hit && t == rec.t;
+        }
+        if (any_hit(query.origin, query.dir, query.t_any) != query.any)
+            right = false;
+        num_wrong += !right;
+    }
+    if (num_wrong)
+        spdlog::error("{}: {} of {} queries wrong", label, num_wrong,
+                      queries.size());
+    else
+        spdlog::info("{}: all {} queries match", label, queries.size());
+    return num_wrong;
+}
+
+int check_accelerator(const std::string &label, const TriangleMesh &scene,
+                      const std::vector<Query> &queries,
+                      const std::function<bool(TriangleMesh &,
+                                               RayTracer::Accelerator &)>
+                          &build) {
+    TriangleMesh mesh = scene;
+    RayTracer::Accelerator accelerator;
+    // Keep the build statistics out of the report
+    spdlog::set_level(spdlog::level::warn);
+    const bool built = build(mesh, accelerator);
+    spdlog::set_level(spdlog::level::info);
+    if (!built) {
+        spdlog::error("{}: build failed", label);
+        return 1;
+    }
+    return check(
+        label, mesh, queries,
+        [&](Vec3f origin, Vec3f dir) {
+            return RayTracer::closest_hit(origin, dir, accelerator, mesh);
+        },
+        [&](Vec3f origin, Vec3f dir, float t_max) {
+            return RayTracer::any_hit(origin, dir, t_max, accelerator, mesh);
+        });
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    spdlog::set_level(spdlog::level::warn);
+    TriangleMesh scene;
+    scene.append(BoxScene::triangles);
+    if (argc > 1) {
+        TriangleMesh obj_triangles = load_obj(argv[1], 5, false, {},
+                                                BoxScene::materials.size());
+        if (obj_triangles.empty()) return 1;
+        scene.append(obj_triangles);
+    } else {
+        scene.append(random_triangles(20000));
+    }
+    const std::vector<Query> queries = make_queries(scene);
+    spdlog::set_level(spdlog::level::info);
+
+    int num_wrong = 0;
+    for (const char *name : {"octree", "bvh", "lbvh", "sbvh", "bvh4", "bvh8"}) {
+        for (bool quantize : {false, true}) {
+            const std::string label =
+                std::string(name) + (quantize ? " quantized" : "");
+            // The binary BVHs have no quantized nodes
+            const bool binary_bvh = std::string(name).ends_with("bvh");
+            if (quantize && binary_bvh) continue;
+            num_wrong += check_accelerator(
+                label, scene, queries,
+                [&](TriangleMesh &mesh, RayTracer::Accelerator &accelerator) {
+                    return RayTracer::build_accelerator(name, mesh,
+                                                        accelerator, quantize);
+                });
+        }
+    }
+
+    // Octree layouts and leaf formats that build_accelerator leaves at
+    // their defaults
+    const std::pair<const char *, std::function<void(RayTracer::Octree &)>>
+        octree_variants[] = {
+            {"octree leaf packets",
+             [](RayTracer::Octree &octree) {
+                 octree.leaf_triangle_packets = true;
+             }},
+            {"octree compressed leaves",
+             [](RayTracer::Octree &octree) {
+                 octree.compress_leaf_indices = true;
+             }},
+            {"octree van Emde Boas",
+             [](RayTracer::Octree &octree) {
+                 octree.van_emde_boas_layout = true;
+                 octree.prefetch_children = true;
+             }},
+            {"octree box overlap only",
+             [](RayTracer::Octree &octree) {
+                 octree.exact_triangle_overlap = false;
+                 octree.clip_node_bounds = false;
+             }},
+        };
+    for (const auto &[label, configure] : octree_variants) {
+        num_wrong += check_accelerator(
+            label, scene, queries,
+            [&](TriangleMesh &mesh, RayTracer::Accelerator &accelerator) {
+                RayTracer::Octree &octree =
+                    accelerator.emplace<RayTracer::Octree>();
+                configure(octree);
+                return octree.build_octree(mesh);
+            });
+    }
+
+    // The scene as a single instance must answer like the flat scene
+    spdlog::set_level(spdlog::level::warn);
+    const auto bottom = RayTracer::BottomLevel::build("bvh4", scene);
+    spdlog::set_level(spdlog::level::info);
+    if (!bottom) return 1;
+    RayTracer::TopLevel instanced;
+    instanced.instances.emplace_back(bottom, Mat3f(linalg::identity),
+                                     Vec3f{0.f});
+    spdlog::set_level(spdlog::level::warn);
+    instanced.build();
+    spdlog::set_level(spdlog::level::info);
+    num_wrong += check(
+        "instanced bvh4", bottom->triangles, queries,
+        [&](Vec3f origin, Vec3f dir) {
+            return RayTracer::closest_hit(origin, dir, instanced);
+        },
+        [&](Vec3f origin, Vec3f dir, float t_max) {
+            return !RayTracer::visible(origin, origin + t_max * dir,
+                                       instanced);
+        });
+
+    return num_wrong == 0 ? 0 : 1;
+}
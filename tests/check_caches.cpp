@@ -0,0 +1,193 @@
+// Round-trips meshes through MeshFile and built structures through
+// AcceleratorCache, checks that loaded structures answer every query exactly
+// like the ones they were saved from, and that stale, mismatched and
+// truncated files are rejected. Exits with 1 on any failure.
+//   xmake run check_caches
+#include "accelerator_cache.h"
+#include "mesh_cache.h"
+#include "scenes/box.h"
+#include "spdlog/spdlog.h"
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace muni;
+
+namespace {
+
+std::string temp_path(const std::string &name) {
+    return (std::filesystem::temp_directory_path() / name).string();
+}
+
+bool report(const std::string &label, bool right) {
+    if (right)
+        spdlog::info("{}: ok", label);
+    else
+        spdlog::error("{}: failed", label);
+    return right;
+}
+
+/** The box and a soup of small random triangles inside it. */
+TriangleMesh make_scene() {
+    std::mt19937 rng(3);
+    std::uniform_real_distribution<float> unit(0.f, 1.f);
+    std::vector<Triangle> triangles;
+    for (int i = 0; i < 5000; i++) {
+        const Vec3f center{0.1f + 0.35f * unit(rng), -0.5f + 0.4f * unit(rng),
+                           0.1f + 0.35f * unit(rng)};
+        Triangle tri{};
+        tri.v0 = center;
+        tri.v1 = center + Vec3f{0.02f * unit(rng), 0.02f * unit(rng), 0.f};
+        tri.v2 = center + Vec3f{0.f, 0.02f * unit(rng), 0.02f * unit(rng)};
+        tri.material_id = i % 4;
+        triangles.push_back(tri);
+    }
+    TriangleMesh scene;
+    scene.append(BoxScene::triangles);
+    scene.append(triangles);
+    return scene;
+}
+
+bool check_mesh_file() {
+    const std::string source = temp_path("muni_check_caches.obj");
+    const std::string path = temp_path("muni_check_caches.mesh");
+    std::ofstream(source) << "v 0 0 0\nv 1 0 0\nv 0 1 0\nf 1 2 3\n";
+
+    std::mt19937 rng(5);
+    std::uniform_real_distribution<float> unit(-1.f, 1.f);
+    std::vector<Vec3f> vertices(1000);
+    for (Vec3f &v : vertices) v = Vec3f{unit(rng), unit(rng), unit(rng)};
+    std::vector<uint32_t> indices(3 * 2000);
+    for (uint32_t &index : indices) index = rng() % vertices.size();
+    std::vector<int32_t> face_materials(2000);
+    for (int32_t &material : face_materials)
+        material = static_cast<int32_t>(rng() % 5) - 1;
+    const std::vector<std::string> material_names = {"wall", "glass", "",
+                                                      "light source"};
+
+    bool ok = report("mesh file save",
+                     MeshFile::save(path, source, vertices, indices,
+                                    face_materials, material_names));
+    MeshFile file;
+    const bool opened = file.open(path, source);
+    ok &= report(
+        "mesh file round trip",
+        opened && file.num_vertices() == vertices.size() &&
+            file.num_faces() == face_materials.size() &&
+            std::equal(vertices.begin(), vertices.end(), file.vertices()) &&
+            std::equal(indices.begin(), indices.end(), file.indices()) &&
+            std::equal(face_materials.begin(), face_materials.end(),
+                       file.face_materials()) &&
+            file.material_names() == material_names);
+    file.close();
+
+    // A changed source makes the file stale
+    std::ofstream(source, std::ios::app) << "f 3 2 1\n";
+    ok &= report("mesh file stale after the source changed",
+                 !file.open(path, source));
+
+    MeshFile::save(path, source, vertices, indices, face_materials,
+                   material_names);
+    std::filesystem::resize_file(path, std::filesystem::file_size(path) - 64);
+    ok &= report("mesh file truncated", !file.open(path, source));
+
+    std::filesystem::remove(source);
+    std::filesystem::remove(path);
+    return ok;
+}
+
+/** Whether two structures give the same closest hits and occlusion results
+    for random rays, bit for bit.
+*/
+bool same_hits(const RayTracer::Accelerator &a, const TriangleMesh &a_mesh,
+               const RayTracer::Accelerator &b, const TriangleMesh &b_mesh) {
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> unit(0.f, 1.f);
+    for (int i = 0; i < 20000; i++) {
+        const Vec3f origin{0.05f + 0.45f * unit(rng),
+                           -0.5f + 0.45f * unit(rng),
+                           0.05f + 0.45f * unit(rng)};
+        const float z = 2.f * unit(rng) - 1.f;
+        const float phi = 6.2831853f * unit(rng);
+        const float r = std::sqrt(1.f - z * z);
+        const Vec3f dir{r * std::cos(phi), r * std::sin(phi), z};
+        const HitRecord hit_a = RayTracer::closest_hit(origin, dir, a, a_mesh);
+        const HitRecord hit_b = RayTracer::closest_hit(origin, dir, b, b_mesh);
+        if (hit_a.t != hit_b.t || hit_a.triangle_idx != hit_b.triangle_idx ||
+            RayTracer::any_hit(origin, dir, 0.2f, a, a_mesh) !=
+                RayTracer::any_hit(origin, dir, 0.2f, b, b_mesh))
+            return false;
+    }
+    return true;
+}
+
+bool check_accelerator_cache(const TriangleMesh &scene) {
+    const std::string path = temp_path("muni_check_caches.accel");
+    bool ok = true;
+    for (const char *name : {"octree", "bvh", "lbvh", "sbvh", "bvh4", "bvh8"}) {
+        for (bool quantize : {false, true}) {
+            const std::string label =
+                std::string(name) + (quantize ? " quantized" : "");
+            // The binary BVHs have no quantized nodes
+            if (quantize && std::string(name).ends_with("bvh")) continue;
+            const uint64_t key =
+                RayTracer::AcceleratorCache::build_key(name, quantize, 42);
+
+            TriangleMesh triangles = scene;
+            RayTracer::Accelerator built;
+            spdlog::set_level(spdlog::level::warn);
+            const bool saved =
+                RayTracer::build_accelerator(name, triangles, built,
+                                             quantize) &&
+                RayTracer::AcceleratorCache::save(path, key, triangles, built);
+            TriangleMesh loaded_triangles;
+            RayTracer::Accelerator loaded;
+            const bool wrong_key_loaded = RayTracer::AcceleratorCache::load(
+                path, key + 1, loaded_triangles, loaded);
+            const bool loaded_ok = RayTracer::AcceleratorCache::load(
+                path, key, loaded_triangles, loaded);
+            spdlog::set_level(spdlog::level::info);
+
+            ok &= report(label + " cache round trip",
+                         saved && loaded_ok &&
+                             loaded.index() == built.index() &&
+                             same_hits(built, triangles, loaded,
+                                       loaded_triangles));
+            ok &= report(label + " cache with another key", !wrong_key_loaded);
+        }
+    }
+
+    // Structures of another name or quantization never share a key
+    ok &= report("keys differ by name and quantize",
+                 RayTracer::AcceleratorCache::build_key("bvh4", false, 42) !=
+                         RayTracer::AcceleratorCache::build_key("bvh8", false,
+                                                                42) &&
+                     RayTracer::AcceleratorCache::build_key("bvh4", false,
+                                                            42) !=
+                         RayTracer::AcceleratorCache::build_key("bvh4", true,
+                                                                42));
+
+    std::filesystem::resize_file(path, std::filesystem::file_size(path) - 100);
+    TriangleMesh triangles;
+    RayTracer::Accelerator accelerator;
+    spdlog::set_level(spdlog::level::off);
+    const uint64_t key = RayTracer::AcceleratorCache::build_key("bvh8", true,
+                                                                42);
+    const bool truncated_loaded =
+        RayTracer::AcceleratorCache::load(path, key, triangles, accelerator);
+    spdlog::set_level(spdlog::level::info);
+    ok &= report("truncated accelerator cache", !truncated_loaded);
+    std::filesystem::remove(path);
+    return ok;
+}
+
+}  // namespace
+
+int main() {
+    bool ok = check_mesh_file();
+    ok &= check_accelerator_cache(make_scene());
+    return ok ? 0 : 1;
+}
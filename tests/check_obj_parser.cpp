@@ -0,0 +1,211 @@
+// Writes synthetic OBJ files and checks that ObjParser returns exactly the
+// vertices, faces and materials they were written from, that it rejects
+// malformed files and that load_obj maps usemtl materials into the scene's
+// table. Exits with 1 on any failure.
+//   xmake run check_obj_parser
+#include "obj_loader.h"
+#include "obj_parser.h"
+#include "spdlog/spdlog.h"
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace muni;
+
+namespace {
+
+/** An OBJ file together with the mesh it describes. */
+struct SyntheticObj {
+    std::string text;
+    std::vector<Vec3f> vertices;
+    std::vector<uint32_t> indices;
+    std::vector<int32_t> face_materials;
+    std::vector<std::string> material_names;
+};
+
+/** Vertices and polygons in the forms exporters write: slashed texture and
+    normal indices, negative indices, polygons split into fans, material
+    switches, comments, CRLF line ends and explicit plus signs.
+    \param[in] num_polygons The number of polygons to write.
+    \param[in] seed Seed of the random vertex positions and polygon shapes.
+    \return The file and the mesh the parser must return for it.
+*/
+SyntheticObj make_obj(size_t num_polygons, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> coordinate(-10.f, 10.f);
+    SyntheticObj obj;
+    const char *materials[] = {"red", "green", "light"};
+    // Numbered in order of first use
+    int32_t material_ids[3] = {-1, -1, -1};
+    int32_t num_materials = 0;
+    int32_t current_material = -1;
+    char number[32];
+
+    obj.text = "# synthetic\nmtllib scene.mtl\no scene\n";
+    for (size_t polygon = 0; polygon < num_polygons; polygon++) {
+        const int corners = 3 + static_cast<int>(rng() % 3);
+        const bool crlf = polygon % 7 == 0;
+        const char *eol = crlf ? "\r\n" : "\n";
+        for (int c = 0; c < corners; c++) {
+            Vec3f v;
+            obj.text += "v";
+            for (int axis = 0; axis < 3; axis++) {
+                v[axis] = coordinate(rng);
+                // Nine significant digits read back to the same float
+                std::snprintf(number, sizeof(number),
+                              polygon % 5 == 0 ? " %+.9g" : " %.9g", v[axis]);
+                obj.text += number;
+            }
+            obj.text += eol;
+            obj.vertices.push_back(v);
+        }
+        if (polygon % 11 == 0) obj.text += "vt 0.5 0.5\nvn 0 0 1\n";
+        if (polygon % 13 == 0) {
+            const int m = static_cast<int>(rng() % 3);
+            if (material_ids[m] < 0) {
+                material_ids[m] = num_materials++;
+                obj.material_names.push_back(materials[m]);
+            }
+            current_material = material_ids[m];
+            obj.text += std::string("usemtl ") + materials[m] + eol;
+        }
+
+        const uint32_t first = static_cast<uint32_t>(obj.vertices.size()) -
+                               static_cast<uint32_t>(corners);
+        obj.text += "f";
+        for (int c = 0; c < corners; c++) {
+            const uint32_t vertex = first + c;
+            switch (polygon % 4) {
+            case 0:
+                obj.text += " " + std::to_string(vertex + 1);
+                break;
+            case 1:
+                obj.text += " " + std::to_string(vertex + 1) + "/1/1";
+                break;
+            case 2:
+                obj.text += " " + std::to_string(vertex + 1) + "//1";
+                break;
+            default:
+                obj.text += " " + std::to_string(static_cast<int64_t>(vertex) -
+                                                 static_cast<int64_t>(
+                                                     obj.vertices.size()));
+            }
+        }
+        obj.text += polygon % 3 == 0 ? " # fan\n" : eol;
+        for (int c = 1; c + 1 < corners; c++) {
+            obj.indices.push_back(first);
+            obj.indices.push_back(first + c);
+            obj.indices.push_back(first + c + 1);
+            obj.face_materials.push_back(current_material);
+        }
+    }
+    return obj;
+}
+
+std::string write_file(const std::string &name, const std::string &text) {
+    const std::string path =
+        (std::filesystem::temp_directory_path() / name).string();
+    std::ofstream(path, std::ios::binary) << text;
+    return path;
+}
+
+bool check_parse(const std::string &label, const SyntheticObj &obj) {
+    const std::string path = write_file("muni_check_parser.obj", obj.text);
+    std::vector<Vec3f> vertices;
+    std::vector<uint32_t> indices;
+    std::vector<int32_t> face_materials;
+    std::vector<std::string> material_names;
+    const bool parsed = ObjParser::parse(path, vertices, indices,
+                                         face_materials, material_names);
+    std::filesystem::remove(path);
+
+    bool same_vertices = vertices.size() == obj.vertices.size();
+    for (size_t i = 0; same_vertices && i < vertices.size(); i++)
+        same_vertices = vertices[i] == obj.vertices[i];
+    const bool same_materials = face_materials == obj.face_materials &&
+                                material_names == obj.material_names;
+    const bool right =
+        parsed && same_vertices && indices == obj.indices && same_materials;
+    if (right)
+        spdlog::info("{}: {} vertices, {} triangles match", label,
+                     vertices.size(), face_materials.size());
+    else
+        spdlog::error("{}: parsed {}, vertices {}, indices {}, materials {}",
+                      label, parsed, same_vertices, indices == obj.indices,
+                      same_materials);
+    return right;
+}
+
+bool check_rejected(const std::string &label, const std::string &text) {
+    const std::string path = write_file("muni_check_parser.obj", text);
+    std::vector<Vec3f> vertices;
+    std::vector<uint32_t> indices;
+    std::vector<int32_t> face_materials;
+    std::vector<std::string> material_names;
+    // The parser logs why it rejects the file
+    spdlog::set_level(spdlog::level::off);
+    const bool parsed = ObjParser::parse(path, vertices, indices,
+                                         face_materials, material_names);
+    spdlog::set_level(spdlog::level::info);
+    std::filesystem::remove(path);
+    if (parsed)
+        spdlog::error("{}: accepted", label);
+    else
+        spdlog::info("{}: rejected", label);
+    return !parsed;
+}
+
+/** Scene materials load_obj gives the faces of a file with usemtl groups,
+    with and without a map from usemtl names to scene materials, and that it
+    rejects materials outside the scene's table.
+*/
+bool check_load_obj_materials() {
+    const std::string path = write_file(
+        "muni_check_parser.obj",
+        "v 0 0 0\nv 1 0 0\nv 0 1 0\nf 1 2 3\nusemtl glass\nf 1 2 3\n"
+        "usemtl wall\nf 1 2 3\nusemtl glass\nf 1 2 3\n");
+    spdlog::set_level(spdlog::level::off);
+    const TriangleMesh unmapped = load_obj(path, 5, false, {}, 7);
+    const TriangleMesh mapped = load_obj(path, 5, false, {{"wall", 2}}, 7);
+    const TriangleMesh bad_id = load_obj(path, 7, false, {}, 7);
+    const TriangleMesh bad_map = load_obj(path, 5, false, {{"glass", 9}}, 7);
+    spdlog::set_level(spdlog::level::info);
+    std::filesystem::remove(path);
+
+    const std::vector<uint32_t> unmapped_ids = {5, 5, 5, 5};
+    const std::vector<uint32_t> mapped_ids = {5, 5, 2, 5};
+    const bool right = unmapped.material_ids == unmapped_ids &&
+                       mapped.material_ids == mapped_ids && bad_id.empty() &&
+                       bad_map.empty();
+    if (right)
+        spdlog::info("load_obj materials: ok");
+    else
+        spdlog::error("load_obj materials: wrong face materials or accepted "
+                      "a material outside the table");
+    return right;
+}
+
+}  // namespace
+
+int main() {
+    bool ok = true;
+    ok &= check_parse("small", make_obj(200, 1));
+    // Large enough to be split into chunks on several threads
+    ok &= check_parse("chunked", make_obj(60000, 2));
+
+    ok &= check_rejected("empty file", "");
+    ok &= check_rejected("no faces", "v 0 0 0\nv 1 0 0\nv 0 1 0\n");
+    ok &= check_rejected("forward reference",
+                         "v 0 0 0\nv 1 0 0\nf 1 2 3\nv 0 1 0\n");
+    ok &= check_rejected("negative index before the first vertex",
+                         "v 0 0 0\nv 1 0 0\nv 0 1 0\nf -1 -2 -4\n");
+    ok &= check_rejected("index 0", "v 0 0 0\nv 1 0 0\nv 0 1 0\nf 0 1 2\n");
+    ok &= check_rejected("two coordinates",
+                         "v 0 0\nv 1 0 0\nv 0 1 0\nf 1 2 3\n");
+    ok &= check_rejected("two corners", "v 0 0 0\nv 1 0 0\nf 1 2\n");
+    ok &= check_load_obj_materials();
+    return ok ? 0 : 1;
+}
@@ -18,7 +18,6 @@ add_requires("spdlog 1.13.0")
 add_requires("stb 2023.01.30")
 add_requires("linalg 2.2")
 add_requires("openmp")
-add_requires("tinyobjloader v2.0.0rc13")
 -- targets
 target("muni-rendering-toolchain")
     set_kind("headeronly")
@@ -26,10 +25,33 @@ target("muni-rendering-toolchain")
     add_packages("spdlog", {public = true})
     add_packages("stb", {public = true})
     add_packages("linalg", {public = true})
-    add_packages("tinyobjloader", {public = true})
 
 target("assignment-4")
     set_kind("binary")
     add_files("src/assignment-4.cpp")
     add_deps("muni-rendering-toolchain")
     add_packages("openmp")
+    -- 8-wide SIMD triangle packets
+    if is_arch("x86_64", "x64") then
+        add_vectorexts("avx2")
+    end
+    -- keep SIMD and scalar ray/triangle tests bit-identical
+    add_cxxflags("-ffp-contract=off", {tools = {"gcc", "clang"}})
+
+-- checks of the accelerators, the OBJ parser and the caches, built on demand:
+--   xmake build -g tests && xmake run check_accelerators
+for _, name in ipairs({"check_accelerators", "check_obj_parser", "check_caches"}) do
+    target(name)
+        set_kind("binary")
+        set_group("tests")
+        set_default(false)
+        add_files("tests/" .. name .. ".cpp")
+        add_deps("muni-rendering-toolchain")
+        -- the packages and flags of assignment-4, so the checks cover the
+        -- headers as they ship
+        add_packages("openmp")
+        if is_arch("x86_64", "x64") then
+            add_vectorexts("avx2")
+        end
+        add_cxxflags("-ffp-contract=off", {tools = {"gcc", "clang"}})
+end